@@ -29,6 +29,8 @@
     ==========================================================================================
 */
 #include "HOG.hpp"
+#include "WorkStealingPool.hpp"
+#include "SimdKernels.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include <iostream>
@@ -36,49 +38,44 @@
 #include <memory>
 #include <vector>
 #include <functional>
+#include <limits>
+#include <cstring>
 #include <math.h>
 #include <iomanip>
 #include <fstream>
+#include <cstdint>
+#include <cstddef>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 // see: https://en.wikipedia.org/wiki/Histogram_of_oriented_gradients#Block_normalization
 void HOG::L1norm(HOG::THist& v) {
-    HOG::TType den = std::accumulate(std::begin(v), std::end(v), 0.0f) + epsilon;
+    HOG::TType den = SimdKernels::sum(v.data(), v.size()) + epsilon;
 
     if (den != 0)
-        std::transform(std::begin(v), std::end(v), std::begin(v), [den](const HOG::TType nom) {
-        return nom / den;
-    });
+        SimdKernels::divide(v.data(), v.size(), den);
 }
 
 void HOG::L1sqrt(HOG::THist& v) {
     HOG::L1norm(v);
-    std::transform(std::begin(v), std::end(v), std::begin(v), [](const HOG::TType x) {
-        return std::sqrt(x);
-    });
+    SimdKernels::sqrt(v.data(), v.size());
 }
 
 void HOG::L2norm(HOG::THist& v) {
-    HOG::THist temp = v;
-    std::transform(std::begin(v), std::end(v), std::begin(temp), [](const HOG::TType & x) {
-        return x * x;
-    });
-    HOG::TType den = std::accumulate(std::begin(temp), std::end(temp), 0.0f);
+    HOG::TType den = SimdKernels::sum_squares(v.data(), v.size());
     den = std::sqrt(den + epsilon);
 
     if (den != 0)
-        std::transform(std::begin(v), std::end(v), std::begin(v), [den](const HOG::TType nom) {
-        return nom / den;
-    });
+        SimdKernels::divide(v.data(), v.size(), den);
 }
 
 void HOG::L2hys(HOG::THist& v) {
     HOG::L2norm(v);
-    auto clip = [](const HOG::TType & x) {
-        if (x > 0.2) return 0.2f;
-        else if (x < 0) return 0.0f;
-        else return x;
-    };
-    std::transform(std::begin(v), std::end(v), std::begin(v), clip);
+    SimdKernels::clamp(v.data(), v.size(), 0.0f, 0.2f);
     HOG::L2norm(v);
 }
 
@@ -153,7 +150,11 @@ HOG::~HOG() {}
 HOG::HOG(const HOG& to_copy) 
     : _blocksize(to_copy._blocksize), _cellsize(to_copy._cellsize), _stride(to_copy._stride), _binning(to_copy._binning),
       _grad_type(to_copy._grad_type), _bin_width(_grad_type / _binning), _block_norm(to_copy._block_norm),
-      _norm_function(to_copy._norm_function) {
+      _norm_function(to_copy._norm_function), _n_phases(to_copy._n_phases), _feature_mode(to_copy._feature_mode),
+      _compute_mode(to_copy._compute_mode), _voting(to_copy._voting), _block_weights(to_copy._block_weights), 
+      _energy_threshold(to_copy._energy_threshold), _n_skipped(to_copy._n_skipped), _features(to_copy._features),
+      mag(to_copy.mag.clone()), ori(to_copy.ori.clone()), _bin_lut(to_copy._bin_lut), _pool(to_copy._pool), 
+      _glyphs(to_copy._glyphs) {
     }
     
 // assignment operator
@@ -171,6 +172,19 @@ HOG& HOG::operator=(const HOG& to_copy) {
     _n_cells_per_block = _n_cells_per_block_y*_n_cells_per_block_x;
     _block_hist_size = _binning*_n_cells_per_block;
     _stride_unit = _stride/_cellsize;
+    _n_phases = to_copy._n_phases;
+    _feature_mode = to_copy._feature_mode;
+    _compute_mode = to_copy._compute_mode;
+    _voting = to_copy._voting;
+    _block_weights = to_copy._block_weights;
+    _energy_threshold = to_copy._energy_threshold;
+    _n_skipped = to_copy._n_skipped;
+    _features = to_copy._features;
+    _bin_lut = to_copy._bin_lut;
+    _pool = to_copy._pool;
+    _glyphs = to_copy._glyphs;
+    mag = to_copy.mag.clone();
+    ori = to_copy.ori.clone();
     return *this;
 }
 
@@ -178,99 +192,1113 @@ void HOG::process(const cv::Mat& img) {
     
     if(!img.data)
         throw std::runtime_error("HOG::process(): invalid image!");
-    if(img.rows < _blocksize || img.cols < _blocksize)
+    if(img.rows < static_cast<int>(_blocksize) || img.cols < static_cast<int>(_blocksize))
         throw std::runtime_error("HOG::process(): the image is smaller than blocksize!");
     
     // cleanup
     clear_internals();
+    
+    // the bins of the fixed-point lookup table are stored on 8 bits
+    const bool fixed_point = _compute_mode == COMPUTE_MODE::fixed_point && img.type() == CV_8U && 
+                             cell_hist_size() <= 255 && _voting == VOTING::hard;
 
     // extracts the magnitude and orientations images
-    magnitude_and_orientation(img);
+    if(fixed_point) {
+        mag.release();
+        ori.release();
+        bins_and_magnitudes_fixed(img);
+    } else {
+        magnitude_and_orientation(img);
+    }
     
-    _n_cells_y = static_cast<int>(mag.rows/_cellsize);
-    _n_cells_x = static_cast<int>(mag.cols/_cellsize);
+    if(!_features)
+        _features = std::make_shared<HOG::FeatureMap>();
+    _features->cells.resize(layout_features(*_features, img.rows, img.cols));
+    _features->cell_data = _features->cells.data();
     
-    _cell_hists.resize(_n_cells_y);
+    // one grid per phase, the grid (0,0) is the one aligned with the image
+    const size_t phase_step = _cellsize/_n_phases;
+    for (size_t py = 0; py < _n_phases; ++py) {
+        for (size_t px = 0; px < _n_phases; ++px) {
+            if(fixed_point)
+                process_grid_fixed(py*_n_phases + px, py*phase_step, px*phase_step);
+            else if(_voting == VOTING::trilinear)
+                process_grid_trilinear(py*_n_phases + px, py*phase_step, px*phase_step);
+            else
+                process_grid(py*_n_phases + px, py*phase_step, px*phase_step);
+        }
+    }
     
-    // iterates over all blocks and cells
-    // We tried to use OpenMP here but with scarce results. The function process_cell()
-    // doesn't consume a great deal of CPU so OpenMP struggle to spread the computation
-    // over multiple threads. The real time-consuming block of code here is the function retrieve().
-    for (size_t i = 0; i < _n_cells_y; ++i) {
-        _cell_hists[i].resize(_n_cells_x);
-        for (size_t j = 0; j < _n_cells_x; ++j) {
-            cv::Rect cell_rect = cv::Rect(j*_cellsize, i*_cellsize, _cellsize, _cellsize);
-            const HOG::THist cell_hist = process_cell(cv::Mat(mag, cell_rect), cv::Mat(ori, cell_rect));
-            _cell_hists[i][j] = cell_hist;
+    if(_feature_mode == FEATURE_MODE::felzenszwalb) {
+        _features->blocks.resize(_features->block_offsets.back());
+        _features->block_data = _features->blocks.data();
+        for (size_t p = 0; p < _n_phases*_n_phases; ++p)
+            compute_fhog(*_features, p);
+    }
+    compute_energy(*_features);
+}
+
+size_t HOG::layout_features(HOG::FeatureMap& features, const size_t rows, const size_t cols) const {
+    const size_t n_grids = _n_phases*_n_phases;
+    const size_t phase_step = _cellsize/_n_phases;
+    features.rows = rows;
+    features.cols = cols;
+    features.grid_rows.resize(n_grids);
+    features.grid_cols.resize(n_grids);
+    features.grid_offsets.resize(n_grids+1);
+    features.block_offsets.resize(n_grids+1);
+    size_t n_values = 0;
+    size_t n_block_values = 0;
+    for (size_t p = 0; p < n_grids; ++p) {
+        const size_t offset_y = (p/_n_phases)*phase_step;
+        const size_t offset_x = (p%_n_phases)*phase_step;
+        features.grid_rows[p] = rows > offset_y ? (rows-offset_y)/_cellsize : 0;
+        features.grid_cols[p] = cols > offset_x ? (cols-offset_x)/_cellsize : 0;
+        features.grid_offsets[p] = n_values;
+        features.block_offsets[p] = n_block_values;
+        n_values += features.grid_rows[p]*features.grid_cols[p]*cell_hist_size();
+        if(_feature_mode == FEATURE_MODE::felzenszwalb)
+            n_block_values += features.grid_rows[p]*features.grid_cols[p]*fhog_size();
+        else if(features.grid_rows[p] >= _n_cells_per_block_y && features.grid_cols[p] >= _n_cells_per_block_x)
+            n_block_values += (features.grid_rows[p]-_n_cells_per_block_y+1)*
+                              (features.grid_cols[p]-_n_cells_per_block_x+1)*_block_hist_size;
+    }
+    features.grid_offsets[n_grids] = n_values;
+    features.block_offsets[n_grids] = n_block_values;
+    return n_values;
+}
+
+void HOG::process_grid(const size_t phase, const size_t offset_y, const size_t offset_x) {
+    
+    const size_t n_cells_y = _features->grid_rows[phase];
+    const size_t n_cells_x = _features->grid_cols[phase];
+    HOG::TType* cell_hists = _features->cells.data() + _features->grid_offsets[phase];
+    
+    // iterates over all blocks and cells, band by band of rows of cells
+    for_each_band(n_cells_y, _features->cols*_cellsize, [&](const size_t first, const size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            for (size_t j = 0; j < n_cells_x; ++j) {
+                cv::Rect cell_rect = cv::Rect(offset_x + j*_cellsize, offset_y + i*_cellsize, _cellsize, _cellsize);
+                process_cell(cv::Mat(mag, cell_rect), cv::Mat(ori, cell_rect), cell_hists + (i*n_cells_x + j)*cell_hist_size());
+            }
         }
-        
+    });
+}
+
+// Minimum number of pixels of a band of HOG::process(), smaller images are processed in one go
+static const size_t PROCESS_BAND_PIXELS = 64*1024;
+
+void HOG::for_each_band(const size_t n_rows, const size_t row_pixels, const std::function<void(const size_t, const size_t)>& body) const {
+    const size_t rows_per_band = std::max<size_t>(1, PROCESS_BAND_PIXELS/std::max<size_t>(1, row_pixels));
+    const size_t n_bands = (n_rows + rows_per_band - 1)/rows_per_band;
+    if(n_bands <= 1) {
+        body(0, n_rows);
+        return;
     }
+    pool().parallel_for(n_bands, [&](const size_t band, const size_t) {
+        body(band*rows_per_band, std::min(n_rows, (band + 1)*rows_per_band));
+    });
+}
+
+void HOG::process_grid_trilinear(const size_t phase, const size_t offset_y, const size_t offset_x) {
+    
+    const size_t n_cells_y = _features->grid_rows[phase];
+    const size_t n_cells_x = _features->grid_cols[phase];
+    const size_t n_bins = cell_hist_size();
+    const size_t width = n_cells_x*_cellsize;
+    HOG::TType* cell_hists = _features->cells.data() + _features->grid_offsets[phase];
+    
+    // FHOG always bins the signed orientation over twice the number of bins
+    const bool is_signed = _grad_type == GRADIENT_SIGNED || _feature_mode == FEATURE_MODE::felzenszwalb;
+    // the exact width, the bins wrap around at 360 or 180 degrees even when binning doesn't divide them
+    const HOG::TType bin_width = static_cast<HOG::TType>(is_signed ? GRADIENT_SIGNED : GRADIENT_UNSIGNED)/n_bins;
+    
+    // Weight of its own cell for each position of a pixel in a cell (from the distance to
+    // the center), the rest goes to the neighbouring cell on the side of the pixel
+    std::vector<HOG::TType> own_weight(_cellsize);
+    std::vector<int> side(_cellsize);
+    for (size_t p = 0; p < _cellsize; ++p) {
+        const HOG::TType u = (p + 0.5)/_cellsize - 0.5;
+        own_weight[p] = 1 - std::abs(u);
+        side[p] = u < 0 ? -1 : 1;
+    }
+    
+    std::fill(cell_hists, cell_hists + n_cells_y*n_cells_x*n_bins, 0);
+    
+    // A band of rows of cells also reads the half cells of pixels above and below it,
+    // whose votes are split with the rows of cells of the neighbouring bands
+    for_each_band(n_cells_y, _features->cols*_cellsize, [&](const size_t first, const size_t last) {
+        std::vector<HOG::TType> row_hist(n_cells_x*n_bins);
+        std::vector<HOG::TType> low(width), high(width);
+        std::vector<int> low_bin(width), high_bin(width);
+        const size_t half = _cellsize/2;
+        const size_t begin = first*_cellsize > half ? first*_cellsize - half : 0;
+        const size_t end = std::min(n_cells_y*_cellsize, last*_cellsize + half);
+        for (size_t r = begin; r < end; ++r) {
+            const HOG::TType* row_mag = mag.ptr<HOG::TType>(offset_y + r) + offset_x;
+            const HOG::TType* row_ori = ori.ptr<HOG::TType>(offset_y + r) + offset_x;
+            
+            // linear interpolation between the two closest bins, orientation is circular
+            for (size_t x = 0; x < width; ++x) {
+                HOG::TType orientation = row_ori[x];
+                if(!is_signed && orientation >= 180)
+                    orientation -= 180;
+                const HOG::TType b = orientation/bin_width - static_cast<HOG::TType>(0.5);
+                const int b0 = std::min(static_cast<int>(std::floor(b)), static_cast<int>(n_bins) - 1);
+                const HOG::TType w = b - b0;
+                high[x] = row_mag[x]*w;
+                low[x] = row_mag[x] - high[x];
+                low_bin[x] = b0 < 0 ? n_bins - 1 : b0;
+                high_bin[x] = b0 + 1 == static_cast<int>(n_bins) ? 0 : b0 + 1;
+            }
+            
+            // bilinear interpolation along x into the histograms of the row of cells
+            std::fill(std::begin(row_hist), std::end(row_hist), 0);
+            for (size_t j = 0; j < n_cells_x; ++j) {
+                HOG::TType* own = row_hist.data() + j*n_bins;
+                for (size_t p = 0; p < _cellsize; ++p) {
+                    const size_t x = j*_cellsize + p;
+                    const HOG::TType w = own_weight[p];
+                    own[low_bin[x]] += w*low[x];
+                    own[high_bin[x]] += w*high[x];
+                    const int neighbour = static_cast<int>(j) + side[p];
+                    if(neighbour >= 0 && neighbour < static_cast<int>(n_cells_x)) {
+                        HOG::TType* other = row_hist.data() + neighbour*n_bins;
+                        other[low_bin[x]] += (1 - w)*low[x];
+                        other[high_bin[x]] += (1 - w)*high[x];
+                    }
+                }
+            }
+            
+            // and along y into the two rows of cells closest to the row of pixels
+            const size_t i = r/_cellsize;
+            const HOG::TType w = own_weight[r%_cellsize];
+            const int neighbour = static_cast<int>(i) + side[r%_cellsize];
+            auto add_row = [&](const size_t cell_y, const HOG::TType weight) {
+                HOG::TType* hists = cell_hists + cell_y*n_cells_x*n_bins;
+                for (size_t k = 0; k < n_cells_x*n_bins; ++k)
+                    hists[k] += weight*row_hist[k];
+            };
+            if(i >= first && i < last)
+                add_row(i, w);
+            if(neighbour >= static_cast<int>(first) && neighbour < static_cast<int>(last))
+                add_row(neighbour, 1 - w);
+        }
+    });
 }
 
 const HOG::THist HOG::retrieve(const cv::Rect& window) {
     
-    if(window.height < _blocksize || window.width < _blocksize)
-        throw std::runtime_error("HOG::retrieve(): the window is smaller than blocksize!");
-    if(window.x > mag.cols-window.width || window.y > mag.rows-window.height)
-        throw std::runtime_error("HOG::retrieve(): the window goes outside of the bounds of the image!");
+    check_window(window, "HOG::retrieve()");
+    
+    HOG::THist hog_hist(descriptor_size(window.size()));
+    HOG::THist block_hist;
+    retrieve_into(window, hog_hist.data(), block_hist);
+    return hog_hist;
+}
+
+void HOG::check_window(const cv::Rect& window, const std::string& caller) const {
+    if(!_features)
+        throw std::runtime_error(caller + ": no image has been processed!");
+    if(window.height < static_cast<int>(_blocksize) || window.width < static_cast<int>(_blocksize))
+        throw std::runtime_error(caller + ": the window is smaller than blocksize!");
+    if(window.x < 0 || window.y < 0 ||
+       window.x > static_cast<int>(_features->cols)-window.width || window.y > static_cast<int>(_features->rows)-window.height)
+        throw std::runtime_error(caller + ": the window goes outside of the bounds of the image!");
+}
+
+cv::Mat HOG::retrieve_batch(const std::vector<cv::Rect>& windows) const {
+    if(windows.empty())
+        return cv::Mat();
+    const size_t size = descriptor_size(windows[0].size());
+    for(const auto& window : windows) {
+        check_window(window, "HOG::retrieve_batch()");
+        if(descriptor_size(window.size()) != size)
+            throw std::runtime_error("HOG::retrieve_batch(): the windows must have the same number of cells!");
+    }
+    
+    cv::Mat descriptors(windows.size(), size, CV_32F);
+    WorkStealingPool& executor = pool();
+    std::vector<HOG::THist> block_hists(executor.max_slots());
+    executor.parallel_for(windows.size(), [&](const size_t i, const size_t slot) {
+        if(skip_window(windows[i]))
+            descriptors.row(i).setTo(0);
+        else
+            retrieve_into(windows[i], descriptors.ptr<HOG::TType>(i), block_hists[slot]);
+    });
+    return descriptors;
+}
+
+std::future<HOG> HOG::process_async(const cv::Mat& img, const ProcessCallback& on_done) const {
+    
+    if(!img.data)
+        throw std::runtime_error("HOG::process_async(): invalid image!");
+    
+    // the task owns its copy of the parameters, so this object can go away in the meantime
+    auto promise = std::make_shared<std::promise<HOG>>();
+    auto hog = std::make_shared<HOG>(worker_copy());
+    hog->_n_phases = _n_phases;
+    pool().submit([promise, hog, img, on_done]() {
+        try {
+            hog->process(img);
+            if(on_done)
+                on_done(*hog);
+            promise->set_value(std::move(*hog));
+        } catch(...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return promise->get_future();
+}
+
+std::future<cv::Mat> HOG::retrieve_async(const std::vector<cv::Rect>& windows, const RetrieveCallback& on_done) const {
+    
+    // the windows are checked now, the errors of the task are stored in the future
+    const size_t size = windows.empty() ? 0 : descriptor_size(windows[0].size());
+    for(const auto& window : windows) {
+        check_window(window, "HOG::retrieve_async()");
+        if(descriptor_size(window.size()) != size)
+            throw std::runtime_error("HOG::retrieve_async(): the windows must have the same number of cells!");
+    }
+    
+    // the copy shares the feature map, that is never modified once computed
+    auto promise = std::make_shared<std::promise<cv::Mat>>();
+    auto hog = std::make_shared<const HOG>(shallow_copy());
+    pool().submit([promise, hog, windows, on_done]() {
+        try {
+            cv::Mat descriptors = hog->retrieve_batch(windows);
+            if(on_done)
+                on_done(descriptors, windows);
+            promise->set_value(descriptors);
+        } catch(...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return promise->get_future();
+}
+
+size_t HOG::descriptor_size(const cv::Size& window) const {
+    const size_t width = static_cast<int>(window.width/_cellsize);
+    const size_t height = static_cast<int>(window.height/_cellsize);
+    if(_feature_mode == FEATURE_MODE::felzenszwalb)
+        return width*height*fhog_size();
+    if(width < _n_cells_per_block_x || height < _n_cells_per_block_y)
+        return 0;
+    const size_t n_blocks_y = (height-_n_cells_per_block_y)/_stride_unit + 1;
+    const size_t n_blocks_x = (width-_n_cells_per_block_x)/_stride_unit + 1;
+    return n_blocks_y*n_blocks_x*_block_hist_size;
+}
+
+void HOG::window_cells(const cv::Rect& window, size_t& phase, size_t& x, size_t& y) const {
+    
+    // select the phase-shifted grid closest to the window's origin (the window is
+    // snapped down to a multiple of cellsize/n_phases)
+    const size_t phase_step = _cellsize/_n_phases;
+    const size_t phase_y = static_cast<int>((window.y%_cellsize)/phase_step);
+    const size_t phase_x = static_cast<int>((window.x%_cellsize)/phase_step);
+    phase = phase_y*_n_phases + phase_x;
     
     // convert the window pixels into cell-units so we can iterate over 
-    // the vector of vectors of cell histograms (_cell_hists)
-    size_t x = static_cast<int>(window.x/_cellsize);
-    size_t y = static_cast<int>(window.y/_cellsize);
+    // the grid of cell histograms of the phase
+    x = static_cast<int>((window.x - phase_x*phase_step)/_cellsize);
+    y = static_cast<int>((window.y - phase_y*phase_step)/_cellsize);
+}
+
+const HOG::TType* HOG::block_at(const size_t phase, const size_t block_y, const size_t block_x, HOG::THist& block_hist) const {
+    if(_features->block_data) {
+        // the blocks have been normalized before saving the feature map
+        const size_t n_blocks_x = _features->grid_cols[phase]-_n_cells_per_block_x+1;
+        return _features->block_data + _features->block_offsets[phase] + (block_y*n_blocks_x + block_x)*_block_hist_size;
+    }
+    compute_block(phase, block_y, block_x, block_hist);
+    return block_hist.data();
+}
+
+void HOG::retrieve_into(const cv::Rect& window, HOG::TType* hog_hist, HOG::THist& block_hist) const {
+    
+    size_t phase, x, y;
+    window_cells(window, phase, x, y);
     size_t width = static_cast<int>(window.width/_cellsize);
     size_t height = static_cast<int>(window.height/_cellsize);
     
+    if(_feature_mode == FEATURE_MODE::felzenszwalb) {
+        // the features of the cells of the window, row by row
+        const size_t n_cells_x = _features->grid_cols[phase];
+        const HOG::TType* features = _features->block_data + _features->block_offsets[phase];
+        for(size_t cell_y=y; cell_y<y+height; ++cell_y) {
+            const HOG::TType* row = features + (cell_y*n_cells_x + x)*fhog_size();
+            hog_hist = std::copy(row, row + width*fhog_size(), hog_hist);
+        }
+        return;
+    }
+    
     // Also here we tried to use OpenMP but with scarce results.
-    HOG::THist hog_hist;
     for(size_t block_y=y; block_y<=y+height-_n_cells_per_block_y; block_y += _stride_unit) {
         for(size_t block_x=x; block_x<=x+width-_n_cells_per_block_x; block_x += _stride_unit) {
-            HOG::THist block_hist;
-            block_hist.reserve(_block_hist_size);
-            for(size_t cell_y=block_y; cell_y<block_y+_n_cells_per_block_y; ++cell_y) {
-                for(size_t cell_x=block_x; cell_x<block_x+_n_cells_per_block_x; ++cell_x) {
-                    const THist cell_hist = _cell_hists[cell_y][cell_x];
-                    block_hist.insert(std::end(block_hist), std::begin(cell_hist), std::end(cell_hist));
+            const HOG::TType* block = block_at(phase, block_y, block_x, block_hist);
+            hog_hist = std::copy(block, block + _block_hist_size, hog_hist);
+        }
+    }
+}
+
+/// Dot product of a block with its weights, the same for the scores and the learnt thresholds
+static HOG::TType block_score(const HOG::TType* weights, const HOG::TType* block, const size_t size) {
+    return SimdKernels::dot(weights, block, size);
+}
+
+HOG::Cascade HOG::make_cascade(const HOG::THist& weights, const HOG::TType bias, const cv::Size& window, const size_t n_stages) const {
+    
+    if(_feature_mode == FEATURE_MODE::felzenszwalb)
+        throw std::runtime_error("HOG::make_cascade(): the cascade needs the blocks of the Dalal-Triggs mode!");
+    if(weights.size() != descriptor_size(window) || weights.empty())
+        throw std::runtime_error("HOG::make_cascade(): the number of weights differs from the size of the window's HOG!");
+    if(n_stages == 0)
+        throw std::runtime_error("HOG::make_cascade(): at least one stage is needed!");
+    
+    // the blocks with the largest weights first, they move the score the most
+    const size_t n_blocks = weights.size()/_block_hist_size;
+    std::vector<HOG::TType> norms(n_blocks);
+    for(size_t b=0; b<n_blocks; ++b)
+        norms[b] = block_score(&weights[b*_block_hist_size], &weights[b*_block_hist_size], _block_hist_size);
+    std::vector<size_t> order(n_blocks);
+    std::iota(std::begin(order), std::end(order), 0);
+    std::stable_sort(std::begin(order), std::end(order), [&norms](const size_t a, const size_t b) { return norms[a] > norms[b]; });
+    
+    // stages doubling in size, so the first ones reject the clear negatives cheaply
+    HOG::Cascade cascade;
+    cascade.weights = weights;
+    cascade.bias = bias;
+    const size_t stages = std::min(n_stages, n_blocks);
+    size_t first = 0;
+    for(size_t s=0; s<stages; ++s) {
+        const size_t last = s+1 == stages ? n_blocks : 
+                            std::max(first+1, static_cast<size_t>(n_blocks*(std::pow(2.0, s+1) - 1)/(std::pow(2.0, stages) - 1)));
+        cascade.stages.emplace_back(std::begin(order)+first, std::begin(order)+last);
+        first = last;
+    }
+    cascade.thresholds.assign(stages, -std::numeric_limits<HOG::TType>::max());
+    return cascade;
+}
+
+void HOG::learn_thresholds(HOG::Cascade& cascade, const cv::Mat& positives, const HOG::TType recall) const {
+    
+    if(positives.empty() || positives.type() != CV_32F || positives.cols != static_cast<int>(cascade.weights.size()))
+        throw std::runtime_error("HOG::learn_thresholds(): the positives must be the CV_32F HOG of the windows of the cascade!");
+    if(recall <= 0 || recall > 1)
+        throw std::runtime_error("HOG::learn_thresholds(): the recall must be in (0,1]!");
+    
+    // partial scores of the positives accepted by the previous stages
+    std::vector<size_t> accepted(positives.rows);
+    std::iota(std::begin(accepted), std::end(accepted), 0);
+    std::vector<HOG::TType> scores(positives.rows, cascade.bias);
+    cascade.thresholds.resize(cascade.stages.size());
+    for(size_t s=0; s<cascade.stages.size() && !accepted.empty(); ++s) {
+        std::vector<HOG::TType> stage_scores;
+        for(const size_t i : accepted) {
+            for(const size_t b : cascade.stages[s])
+                scores[i] += block_score(&cascade.weights[b*_block_hist_size], positives.ptr<HOG::TType>(i) + b*_block_hist_size, 
+                                         _block_hist_size);
+            stage_scores.push_back(scores[i]);
+        }
+        // the threshold keeps a fraction "recall" of the positives of the stage
+        std::sort(std::begin(stage_scores), std::end(stage_scores));
+        cascade.thresholds[s] = stage_scores[static_cast<size_t>((1-recall)*stage_scores.size())];
+        accepted.erase(std::remove_if(std::begin(accepted), std::end(accepted), 
+                                      [&](const size_t i) { return scores[i] < cascade.thresholds[s]; }), std::end(accepted));
+    }
+}
+
+void HOG::check_cascade(const HOG::Cascade& cascade, const cv::Size& window, const std::string& caller) const {
+    if(_feature_mode == FEATURE_MODE::felzenszwalb)
+        throw std::runtime_error(caller + ": the cascade needs the blocks of the Dalal-Triggs mode!");
+    if(cascade.weights.size() != descriptor_size(window))
+        throw std::runtime_error(caller + ": the number of weights differs from the size of the window's HOG!");
+    if(cascade.thresholds.size() != cascade.stages.size())
+        throw std::runtime_error(caller + ": one threshold per stage is needed!");
+    const size_t n_blocks = cascade.weights.size()/_block_hist_size;
+    for(const auto& stage : cascade.stages)
+        for(const size_t b : stage)
+            if(b >= n_blocks)
+                throw std::runtime_error(caller + ": the stages refer to blocks outside of the window!");
+}
+
+bool HOG::cascade_score(const cv::Rect& window, const HOG::Cascade& cascade, HOG::TType& score, 
+                        HOG::THist& block_hist, size_t& n_blocks) const {
+    
+    size_t phase, x, y;
+    window_cells(window, phase, x, y);
+    const size_t n_blocks_x = (window.width/_cellsize - _n_cells_per_block_x)/_stride_unit + 1;
+    
+    // the blocks are built and normalized only until the window is rejected
+    score = cascade.bias;
+    for(size_t s=0; s<cascade.stages.size(); ++s) {
+        for(const size_t b : cascade.stages[s]) {
+            const HOG::TType* block = block_at(phase, y + (b/n_blocks_x)*_stride_unit, x + (b%n_blocks_x)*_stride_unit, block_hist);
+            if(!_features->block_data)
+                ++n_blocks;
+            score += block_score(&cascade.weights[b*_block_hist_size], block, _block_hist_size);
+        }
+        if(score < cascade.thresholds[s])
+            return false;
+    }
+    return true;
+}
+
+bool HOG::cascade_score(const cv::Rect& window, const HOG::Cascade& cascade, HOG::TType& score) const {
+    check_window(window, "HOG::cascade_score()");
+    check_cascade(cascade, window.size(), "HOG::cascade_score()");
+    HOG::THist block_hist;
+    size_t n_blocks = 0;
+    return cascade_score(window, cascade, score, block_hist, n_blocks);
+}
+
+std::vector<cv::Rect> HOG::detect(const cv::Size& window, const size_t stride, const HOG::Cascade& cascade, 
+                                  std::vector<HOG::TType>& scores, HOG::CascadeStats* stats) const {
+    
+    check_cascade(cascade, window, "HOG::detect()");
+    std::vector<cv::Rect> windows;
+    const std::vector<size_t> first_row = scan_tiles(window, stride, windows);
+    return detect_tiles(windows, first_row, cascade, scores, stats);
+}
+
+std::vector<cv::Rect> HOG::detect_tiles(const std::vector<cv::Rect>& windows, const std::vector<size_t>& first_row, 
+                                        const HOG::Cascade& cascade, std::vector<HOG::TType>& scores, 
+                                        HOG::CascadeStats* stats) const {
+    
+    // the detections of each tile are merged in the order of the tiles
+    const size_t n_tiles = first_row.size()-1;
+    std::vector<std::vector<std::pair<cv::Rect, HOG::TType>>> detections(n_tiles);
+    WorkStealingPool& executor = pool();
+    std::vector<HOG::THist> block_hists(executor.max_slots());
+    std::vector<size_t> n_blocks(executor.max_slots(), 0);
+    std::vector<size_t> n_skipped(executor.max_slots(), 0);
+    executor.parallel_for(n_tiles, [&](const size_t t, const size_t slot) {
+        for(size_t i=first_row[t]; i<first_row[t+1]; ++i) {
+            HOG::TType score;
+            if(skip_window(windows[i]))
+                ++n_skipped[slot];
+            else if(cascade_score(windows[i], cascade, score, block_hists[slot], n_blocks[slot]))
+                detections[t].push_back(std::make_pair(windows[i], score));
+        }
+    });
+    
+    std::vector<cv::Rect> accepted;
+    scores.clear();
+    for(const auto& tile : detections) {
+        for(const auto& detection : tile) {
+            accepted.push_back(detection.first);
+            scores.push_back(detection.second);
+        }
+    }
+    if(stats) {
+        // the skipped windows are counted apart from the ones rejected by the stages
+        stats->n_windows = windows.size();
+        stats->n_skipped = std::accumulate(std::begin(n_skipped), std::end(n_skipped), size_t(0));
+        stats->n_rejected = windows.size() - accepted.size() - stats->n_skipped;
+        stats->n_blocks = std::accumulate(std::begin(n_blocks), std::end(n_blocks), size_t(0));
+    }
+    return accepted;
+}
+
+HOG::RowReader HOG::mat_reader(const cv::Mat& img) {
+    return [img](const size_t y, cv::Mat& rows) {
+        img.rowRange(y, y + rows.rows).copyTo(rows);
+    };
+}
+
+void HOG::stream(const cv::Size& image_size, const int type, const RowReader& read, const cv::Size& window,
+                 const size_t stride, const size_t band_height, const BandConsumer& consume) const {
+    stream_bands(image_size, type, read, window, stride, band_height, "HOG::stream()",
+                 [&consume](const HOG& band, const std::vector<cv::Rect>& windows, const size_t offset_y) {
+        cv::Mat descriptors = band.retrieve_batch(windows);
+        std::vector<cv::Rect> image_windows(windows);
+        for(auto& window : image_windows)
+            window.y += offset_y;
+        consume(descriptors, image_windows);
+    });
+}
+
+void HOG::stream_detect(const cv::Size& image_size, const int type, const RowReader& read, const cv::Size& window,
+                        const size_t stride, const size_t band_height, const Cascade& cascade, 
+                        const DetectionConsumer& consume, CascadeStats* stats) const {
+    check_cascade(cascade, window, "HOG::stream_detect()");
+    if(stats)
+        *stats = CascadeStats();
+    stream_bands(image_size, type, read, window, stride, band_height, "HOG::stream_detect()",
+                 [&](const HOG& band, const std::vector<cv::Rect>& windows, const size_t offset_y) {
+        // one tile per row of windows
+        const size_t n_x = (image_size.width - window.width)/stride + 1;
+        std::vector<size_t> first_row;
+        for(size_t i=0; i<=windows.size(); i+=n_x)
+            first_row.push_back(i);
+        std::vector<HOG::TType> scores;
+        HOG::CascadeStats band_stats;
+        std::vector<cv::Rect> detections = band.detect_tiles(windows, first_row, cascade, scores, &band_stats);
+        for(auto& detection : detections)
+            detection.y += offset_y;
+        if(stats) {
+            stats->n_windows += band_stats.n_windows;
+            stats->n_rejected += band_stats.n_rejected;
+            stats->n_blocks += band_stats.n_blocks;
+            stats->n_skipped += band_stats.n_skipped;
+        }
+        consume(detections, scores);
+    });
+}
+
+static size_t greatest_common_divisor(size_t a, size_t b) {
+    while(b) {
+        const size_t r = a%b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+void HOG::stream_bands(const cv::Size& image_size, const int type, const RowReader& read, const cv::Size& window,
+                       const size_t stride, const size_t band_height, const std::string& caller,
+                       const std::function<void(const HOG&, const std::vector<cv::Rect>&, const size_t)>& process_band) const {
+    
+    if(window.height < static_cast<int>(_blocksize) || window.width < static_cast<int>(_blocksize))
+        throw std::runtime_error(caller + ": the window is smaller than blocksize!");
+    if(window.width > image_size.width || window.height > image_size.height)
+        throw std::runtime_error(caller + ": the window is bigger than the image!");
+    if(stride == 0)
+        throw std::runtime_error(caller + ": the stride must be positive!");
+    if(band_height < static_cast<size_t>(window.height))
+        throw std::runtime_error(caller + ": the bands must be at least as high as the windows!");
+    
+    const size_t n_rows = image_size.height;
+    const size_t n_y = (n_rows - window.height)/stride + 1;
+    const size_t n_x = (image_size.width - window.width)/stride + 1;
+    
+    // The bands start on a cell boundary, so their cell grids are the ones of the whole
+    // image and the windows get the same HOG as with process() and retrieve().
+    // FHOG normalizes each cell with its neighbours: one more cell above and below.
+    // With trilinear voting the cells also take votes from the half cells around them,
+    // one more cell again (two with FHOG, for the votes in the neighbours).
+    const size_t step = _cellsize/greatest_common_divisor(stride, _cellsize);
+    const size_t per_band = std::max(step, ((band_height - window.height)/stride + 1)/step*step);
+    const size_t halo = (_feature_mode == FEATURE_MODE::felzenszwalb ? _cellsize : 0) + 
+                        (_voting == VOTING::trilinear ? _cellsize : 0);
+    
+    // the rows of the current band, plus the row above and below it for the gradients
+    cv::Mat buffer((per_band-1)*stride + window.height + 2*halo + 2, image_size.width, type);
+    size_t buffer_y0 = 0, buffer_y1 = 0;
+    
+    HOG band = worker_copy();
+    band._n_phases = _n_phases;
+    std::vector<cv::Rect> windows;
+    for(size_t first=0; first<n_y; first+=per_band) {
+        const size_t last = std::min(first+per_band, n_y);
+        const size_t y0 = first*stride;
+        const size_t y1 = (last-1)*stride + window.height;
+        const size_t band_y0 = y0 - std::min(halo, y0);
+        const size_t band_y1 = std::min(y1 + halo, n_rows);
+        const size_t need_y0 = band_y0 > 0 ? band_y0-1 : 0;
+        const size_t need_y1 = std::min(band_y1 + 1, n_rows);
+        
+        // the rows shared with the previous band are moved up, only the new ones are read
+        size_t read_y0 = need_y0;
+        if(need_y0 >= buffer_y0 && need_y0 < buffer_y1) {
+            for(size_t y=need_y0; y<buffer_y1; ++y)
+                std::memmove(buffer.ptr(y-need_y0), buffer.ptr(y-buffer_y0), buffer.cols*buffer.elemSize());
+            read_y0 = buffer_y1;
+        }
+        if(read_y0 < need_y1) {
+            cv::Mat rows = buffer.rowRange(read_y0-need_y0, need_y1-need_y0);
+            const uchar* data = rows.data;
+            read(read_y0, rows);
+            if(rows.data != data)
+                throw std::runtime_error(caller + ": the reader must fill the given rows, not reallocate them!");
+        }
+        buffer_y0 = need_y0;
+        buffer_y1 = need_y1;
+        
+        // a header limited to the rows read, so that the gradients use the rows around
+        // the band but not the stale ones at the end of the buffer
+        cv::Mat rows_read(need_y1-need_y0, buffer.cols, buffer.type(), buffer.data, buffer.step);
+        band.process(rows_read.rowRange(band_y0-need_y0, band_y1-need_y0));
+        
+        windows.clear();
+        for(size_t k=first; k<last; ++k)
+            for(size_t j=0; j<n_x; ++j)
+                windows.push_back(cv::Rect(j*stride, k*stride-band_y0, window.width, window.height));
+        process_band(band, windows, band_y0);
+    }
+}
+
+cv::Mat HOG::process_batch(const std::vector<cv::Mat>& crops) {
+    
+    if(crops.empty())
+        return cv::Mat();
+    const size_t size = descriptor_size(crops[0].size());
+    for(const auto& crop : crops) {
+        if(!crop.data)
+            throw std::runtime_error("HOG::process_batch(): invalid image!");
+        if(descriptor_size(crop.size()) != size)
+            throw std::runtime_error("HOG::process_batch(): the crops must have the same number of cells!");
+    }
+    
+    // the crops are spread over the pool, each slot reuses its own HOG (and buffers) for all its crops
+    cv::Mat descriptors(crops.size(), size, CV_32F);
+    WorkStealingPool& executor = pool();
+    std::vector<std::unique_ptr<HOG>> workers(executor.max_slots());
+    std::vector<HOG::THist> block_hists(executor.max_slots());
+    executor.parallel_for(crops.size(), [&](const size_t i, const size_t slot) {
+        if(!workers[slot])
+            workers[slot].reset(new HOG(worker_copy()));
+        workers[slot]->process(crops[i]);
+        workers[slot]->retrieve_into(cv::Rect(0, 0, crops[i].cols, crops[i].rows), 
+                                     descriptors.ptr<HOG::TType>(i), block_hists[slot]);
+    });
+    return descriptors;
+}
+
+std::vector<HOG> HOG::process_pyramid(const cv::Mat& img, const cv::Size& min_size, const size_t levels_per_octave, 
+                                      const size_t real_per_octave, std::vector<double>& scales, const HOG::TType lambda) const {
+    
+    if(!img.data)
+        throw std::runtime_error("HOG::process_pyramid(): invalid image!");
+    if(min_size.height < static_cast<int>(_blocksize) || min_size.width < static_cast<int>(_blocksize))
+        throw std::runtime_error("HOG::process_pyramid(): min_size is smaller than blocksize!");
+    if(levels_per_octave == 0 || real_per_octave == 0 || levels_per_octave % real_per_octave != 0)
+        throw std::runtime_error("HOG::process_pyramid(): real_per_octave must divide levels_per_octave!");
+    
+    scales.clear();
+    std::vector<cv::Size> sizes;
+    for(size_t i = 0;; ++i) {
+        const double scale = std::pow(2.0, -static_cast<double>(i)/levels_per_octave);
+        const cv::Size size(static_cast<int>(std::round(img.cols*scale)), static_cast<int>(std::round(img.rows*scale)));
+        if(size.width < min_size.width || size.height < min_size.height)
+            break;
+        scales.push_back(scale);
+        sizes.push_back(size);
+    }
+    
+    std::vector<HOG> levels;
+    levels.reserve(scales.size());
+    for(size_t i = 0; i < scales.size(); ++i) {
+        levels.push_back(worker_copy());
+        levels.back()._n_phases = _n_phases;
+    }
+    
+    // every real_step-th level is processed, the others are resampled from the real level above them
+    const size_t real_step = levels_per_octave/real_per_octave;
+    std::vector<size_t> real, approximated;
+    for(size_t i = 0; i < scales.size(); ++i)
+        (i % real_step == 0 ? real : approximated).push_back(i);
+    
+    WorkStealingPool& executor = pool();
+    executor.parallel_for(real.size(), [&](const size_t k, const size_t) {
+        const size_t i = real[k];
+        if(i == 0) {
+            levels[i].process(img);
+        } else {
+            cv::Mat resized;
+            cv::resize(img, resized, sizes[i], 0, 0, cv::INTER_LINEAR);
+            levels[i].process(resized);
+        }
+    });
+    executor.parallel_for(approximated.size(), [&](const size_t k, const size_t) {
+        const size_t i = approximated[k];
+        const size_t r = i - i % real_step;
+        levels[i].approximate_level(levels[r], scales[i]/scales[r], sizes[i], lambda);
+    });
+    return levels;
+}
+
+void HOG::approximate_level(const HOG& real, const double ratio, const cv::Size& size, const HOG::TType lambda) {
+    
+    clear_internals();
+    mag.release();
+    ori.release();
+    if(!_features)
+        _features = std::make_shared<HOG::FeatureMap>();
+    _features->cells.resize(layout_features(*_features, size.height, size.width));
+    _features->cell_data = _features->cells.data();
+    
+    // the cells of both levels cover cellsize x cellsize pixels, so only the mean
+    // gradient energy per pixel changes between the two scales
+    const HOG::FeatureMap& source = *real._features;
+    const size_t hist_size = cell_hist_size();
+    const long source_rows = source.grid_rows[0];
+    const long source_cols = source.grid_cols[0];
+    const HOG::TType gain = std::pow(ratio, -lambda);
+    
+    // position of a cell center of this level in the cell-aligned grid of the real level
+    auto source_cell = [this, ratio](const size_t offset, const size_t i, const long n, long& c0, long& c1, HOG::TType& w) {
+        const double c = std::min(std::max((offset + (i + 0.5)*_cellsize)/ratio/_cellsize - 0.5, 0.0), n - 1.0);
+        c0 = static_cast<long>(c);
+        c1 = std::min(c0 + 1, n - 1);
+        w = static_cast<HOG::TType>(c - c0);
+    };
+    
+    const size_t phase_step = _cellsize/_n_phases;
+    for (size_t p = 0; p < _n_phases*_n_phases; ++p) {
+        const size_t n_cells_x = _features->grid_cols[p];
+        HOG::TType* cells = _features->cells.data() + _features->grid_offsets[p];
+        for (size_t i = 0; i < _features->grid_rows[p]; ++i) {
+            long y0, y1;
+            HOG::TType wy;
+            source_cell((p/_n_phases)*phase_step, i, source_rows, y0, y1, wy);
+            for (size_t j = 0; j < n_cells_x; ++j) {
+                long x0, x1;
+                HOG::TType wx;
+                source_cell((p%_n_phases)*phase_step, j, source_cols, x0, x1, wx);
+                const HOG::TType* c00 = source.cell_data + (y0*source_cols + x0)*hist_size;
+                const HOG::TType* c01 = source.cell_data + (y0*source_cols + x1)*hist_size;
+                const HOG::TType* c10 = source.cell_data + (y1*source_cols + x0)*hist_size;
+                const HOG::TType* c11 = source.cell_data + (y1*source_cols + x1)*hist_size;
+                HOG::TType* cell = cells + (i*n_cells_x + j)*hist_size;
+                for (size_t b = 0; b < hist_size; ++b)
+                    cell[b] = gain*((1 - wy)*((1 - wx)*c00[b] + wx*c01[b]) + wy*((1 - wx)*c10[b] + wx*c11[b]));
+            }
+        }
+    }
+    
+    if(_feature_mode == FEATURE_MODE::felzenszwalb) {
+        _features->blocks.resize(_features->block_offsets.back());
+        _features->block_data = _features->blocks.data();
+        for (size_t p = 0; p < _n_phases*_n_phases; ++p)
+            compute_fhog(*_features, p);
+    }
+    compute_energy(*_features);
+}
+
+// Upper bound of the features read by a tile of windows in HOG::scan(), about the size of a L2 cache
+static const size_t SCAN_TILE_BYTES = 256*1024;
+
+std::vector<size_t> HOG::scan_tiles(const cv::Size& window, const size_t stride, std::vector<cv::Rect>& windows) const {
+    
+    if(!_features)
+        throw std::runtime_error("HOG::scan(): no image has been processed!");
+    if(window.height < static_cast<int>(_blocksize) || window.width < static_cast<int>(_blocksize))
+        throw std::runtime_error("HOG::scan(): the window is smaller than blocksize!");
+    if(window.width > static_cast<int>(_features->cols) || window.height > static_cast<int>(_features->rows))
+        throw std::runtime_error("HOG::scan(): the window is bigger than the image!");
+    if(stride == 0)
+        throw std::runtime_error("HOG::scan(): the stride must be positive!");
+    
+    const size_t n_x = (_features->cols - window.width)/stride + 1;
+    const size_t n_y = (_features->rows - window.height)/stride + 1;
+    
+    // Neighbouring windows share most of their cells, so the lattice of windows is split
+    // in square tiles whose features and descriptors fit together in SCAN_TILE_BYTES.
+    // The tiles are kept small enough to give a few of them to each thread for the balance.
+    size_t bytes_per_cell = cell_hist_size()*sizeof(TType);
+    if(_feature_mode == FEATURE_MODE::felzenszwalb)
+        bytes_per_cell = fhog_size()*sizeof(TType);
+    else if(_features->block_data)
+        bytes_per_cell = _block_hist_size*sizeof(TType);
+    const size_t bytes_per_window = descriptor_size(window)*sizeof(TType);
+    auto tile_bytes = [&](const size_t tile) {
+        return (((tile-1)*stride + window.height)/_cellsize + 1)*
+               (((tile-1)*stride + window.width)/_cellsize + 1)*bytes_per_cell + tile*tile*bytes_per_window;
+    };
+    WorkStealingPool& executor = pool();
+    size_t tile = 1;
+    while(tile < std::max(n_x, n_y) && tile_bytes(tile+1) <= SCAN_TILE_BYTES)
+        ++tile;
+    while(tile > 1 && ((n_x+tile-1)/tile)*((n_y+tile-1)/tile) < 4*executor.max_slots())
+        --tile;
+    const size_t n_tiles_x = (n_x+tile-1)/tile;
+    const size_t n_tiles_y = (n_y+tile-1)/tile;
+    
+    // the windows of a tile are consecutive, so each tile is a contiguous slab of the output
+    std::vector<size_t> first_row(n_tiles_x*n_tiles_y + 1);
+    windows.clear();
+    windows.reserve(n_x*n_y);
+    for(size_t tile_y=0; tile_y<n_tiles_y; ++tile_y) {
+        for(size_t tile_x=0; tile_x<n_tiles_x; ++tile_x) {
+            first_row[tile_y*n_tiles_x + tile_x] = windows.size();
+            for(size_t y=tile_y*tile; y<std::min((tile_y+1)*tile, n_y); ++y)
+                for(size_t x=tile_x*tile; x<std::min((tile_x+1)*tile, n_x); ++x)
+                    windows.push_back(cv::Rect(x*stride, y*stride, window.width, window.height));
+        }
+    }
+    first_row.back() = windows.size();
+    return first_row;
+}
+
+cv::Mat HOG::scan(const cv::Size& window, const size_t stride, std::vector<cv::Rect>& windows) const {
+    const std::vector<size_t> first_row = scan_tiles(window, stride, windows);
+    cv::Mat descriptors(windows.size(), descriptor_size(window), CV_32F);
+    WorkStealingPool& executor = pool();
+    std::vector<HOG::THist> block_hists(executor.max_slots());
+    executor.parallel_for(first_row.size()-1, [&](const size_t t, const size_t slot) {
+        for(size_t row=first_row[t]; row<first_row[t+1]; ++row) {
+            if(skip_window(windows[row]))
+                descriptors.row(row).setTo(0);
+            else
+                retrieve_into(windows[row], descriptors.ptr<HOG::TType>(row), block_hists[slot]);
+        }
+    });
+    return descriptors;
+}
+
+void HOG::scan(const cv::Size& window, const size_t stride, const ScanConsumer& consume) const {
+    std::vector<cv::Rect> windows;
+    const std::vector<size_t> first_row = scan_tiles(window, stride, windows);
+    size_t max_tile = 0;
+    for(size_t t=0; t+1<first_row.size(); ++t)
+        max_tile = std::max(max_tile, first_row[t+1]-first_row[t]);
+    
+    // one slab per thread, reused for all the tiles of the thread
+    WorkStealingPool& executor = pool();
+    std::vector<cv::Mat> slabs(executor.max_slots());
+    std::vector<HOG::THist> block_hists(executor.max_slots());
+    executor.parallel_for(first_row.size()-1, [&](const size_t t, const size_t slot) {
+        if(slabs[slot].empty())
+            slabs[slot].create(max_tile, descriptor_size(window), CV_32F);
+        const size_t n_windows = first_row[t+1]-first_row[t];
+        for(size_t i=0; i<n_windows; ++i) {
+            if(skip_window(windows[first_row[t]+i]))
+                slabs[slot].row(i).setTo(0);
+            else
+                retrieve_into(windows[first_row[t]+i], slabs[slot].ptr<HOG::TType>(i), block_hists[slot]);
+        }
+        consume(slabs[slot].rowRange(0, n_windows), &windows[first_row[t]]);
+    });
+}
+
+HOG HOG::worker_copy() const {
+    HOG worker(_blocksize, _cellsize, _stride, _binning, _grad_type, _norm_function);
+    worker._feature_mode = _feature_mode;
+    worker._compute_mode = _compute_mode;
+    worker._voting = _voting;
+    worker._block_weights = _block_weights;
+    worker._energy_threshold = _energy_threshold;
+    worker._n_skipped = _n_skipped;
+    worker._bin_lut = _bin_lut;
+    worker._pool = _pool;
+    return worker;
+}
+
+HOG HOG::shallow_copy() const {
+    HOG copy = worker_copy();
+    copy._n_phases = _n_phases;
+    copy._features = _features;
+    return copy;
+}
+
+WorkStealingPool& HOG::pool() const {
+    return _pool ? *_pool : *WorkStealingPool::default_pool();
+}
+
+void HOG::set_num_threads(const size_t n_threads) {
+    _pool = std::make_shared<WorkStealingPool>(n_threads);
+}
+
+void HOG::set_pool(const std::shared_ptr<WorkStealingPool>& pool) {
+    _pool = pool;
+}
+
+void HOG::compute_block(const size_t phase, const size_t block_y, const size_t block_x, HOG::THist& block_hist) const {
+    const size_t n_cells_x = _features->grid_cols[phase];
+    const HOG::TType* cell_hists = _features->cell_data + _features->grid_offsets[phase];
+    block_hist.clear();
+    block_hist.reserve(_block_hist_size);
+    for(size_t cell_y=block_y; cell_y<block_y+_n_cells_per_block_y; ++cell_y) {
+        const HOG::TType* cell_hist = cell_hists + (cell_y*n_cells_x + block_x)*_binning;
+        block_hist.insert(std::end(block_hist), cell_hist, cell_hist + _n_cells_per_block_x*_binning);
+    }
+    if(!_block_weights.empty()) {
+        for(size_t c = 0; c < _n_cells_per_block; ++c)
+            std::transform(&block_hist[c*_binning], &block_hist[(c+1)*_binning], &block_hist[c*_binning],
+                           [&](const HOG::TType v) { return v*_block_weights[c]; });
+    }
+    _block_norm(block_hist);
+}
+
+// number of fractional bits of the fixed-point magnitudes
+static const int FIXED_POINT_SHIFT = 4;
+// the gradients of a CV_8U image are in [-255, 255]
+static const int MAX_GRADIENT = 255;
+
+/// Table of round(sqrt(m2) * 2^FIXED_POINT_SHIFT) for every squared magnitude m2 = dx*dx + dy*dy
+static const std::vector<uint16_t>& fixed_point_sqrt() {
+    static const std::vector<uint16_t> table = []() {
+        std::vector<uint16_t> t(2*MAX_GRADIENT*MAX_GRADIENT + 1);
+        for(size_t m2 = 0; m2 < t.size(); ++m2)
+            t[m2] = static_cast<uint16_t>(std::lround(std::sqrt(static_cast<double>(m2))*(1 << FIXED_POINT_SHIFT)));
+        return t;
+    }();
+    return table;
+}
+
+void HOG::bins_and_magnitudes_fixed(const cv::Mat& img) {
+    
+    // the bin of each gradient, following the same rules as process_cell()
+    const size_t n_bins = cell_hist_size();
+    const size_t bin_width = _feature_mode == FEATURE_MODE::felzenszwalb ? GRADIENT_SIGNED / n_bins : _bin_width;
+    const bool is_signed = _grad_type == GRADIENT_SIGNED || _feature_mode == FEATURE_MODE::felzenszwalb;
+    if(!_bin_lut) {
+        const int side = 2*MAX_GRADIENT + 1;
+        auto lut = std::make_shared<std::vector<uint8_t>>(side*side);
+        for(int dy = -MAX_GRADIENT; dy <= MAX_GRADIENT; ++dy) {
+            for(int dx = -MAX_GRADIENT; dx <= MAX_GRADIENT; ++dx) {
+                double orientation = std::atan2(static_cast<double>(dy), static_cast<double>(dx))*180.0/CV_PI;
+                if(orientation < 0)
+                    orientation += 360;
+                if(!is_signed && orientation >= 180)
+                    orientation -= 180;
+                (*lut)[(dy + MAX_GRADIENT)*side + dx + MAX_GRADIENT] = 
+                    static_cast<uint8_t>(std::min(static_cast<size_t>(orientation / bin_width), n_bins-1));
+            }
+        }
+        _bin_lut = lut;
+    }
+    const uint8_t* bin_lut = _bin_lut->data() + MAX_GRADIENT*(2*MAX_GRADIENT + 1) + MAX_GRADIENT;
+    const uint16_t* sqrt_lut = fixed_point_sqrt().data();
+    
+    // like filter2D(), the pixels around a ROI are used when available, 
+    // otherwise the border is reflected (BORDER_REFLECT_101)
+    cv::Size whole_size;
+    cv::Point offset;
+    img.locateROI(whole_size, offset);
+    const bool has_left = offset.x > 0;
+    const bool has_right = offset.x + img.cols < whole_size.width;
+    const bool has_top = offset.y > 0;
+    const bool has_bottom = offset.y + img.rows < whole_size.height;
+    
+    _bins.create(img.size(), CV_8U);
+    _mags_q.create(img.size(), CV_16U);
+    const int cols = img.cols;
+    for_each_band(img.rows, img.cols, [&](const size_t first, const size_t last) {
+        std::vector<int16_t> dx(cols), dy(cols);
+        for (int i = first; i < static_cast<int>(last); ++i) {
+            const uint8_t* row = img.ptr<uint8_t>(i);
+            const uint8_t* up = i > 0 ? img.ptr<uint8_t>(i-1) : (has_top ? row - img.step : img.ptr<uint8_t>(1));
+            const uint8_t* down = i < img.rows-1 ? img.ptr<uint8_t>(i+1) : 
+                                  (has_bottom ? row + img.step : img.ptr<uint8_t>(img.rows-2));
+            
+            // plain int16 loops, left to the compiler's vectorizer
+            for (int j = 1; j < cols-1; ++j)
+                dx[j] = static_cast<int16_t>(row[j+1] - row[j-1]);
+            dx[0] = has_left ? static_cast<int16_t>(row[1] - row[-1]) : 0;
+            dx[cols-1] = has_right ? static_cast<int16_t>(row[cols] - row[cols-2]) : 0;
+            for (int j = 0; j < cols; ++j)
+                dy[j] = static_cast<int16_t>(down[j] - up[j]);
+            
+            uint8_t* bins = _bins.ptr<uint8_t>(i);
+            uint16_t* mags = _mags_q.ptr<uint16_t>(i);
+            for (int j = 0; j < cols; ++j) {
+                mags[j] = sqrt_lut[dx[j]*dx[j] + dy[j]*dy[j]];
+                bins[j] = bin_lut[dy[j]*(2*MAX_GRADIENT + 1) + dx[j]];
+            }
+        }
+    });
+}
+
+void HOG::process_grid_fixed(const size_t phase, const size_t offset_y, const size_t offset_x) {
+    
+    const size_t n_cells_y = _features->grid_rows[phase];
+    const size_t n_cells_x = _features->grid_cols[phase];
+    const size_t n_bins = cell_hist_size();
+    HOG::TType* cell_hists = _features->cells.data() + _features->grid_offsets[phase];
+    const HOG::TType scale = 1.0f/(1 << FIXED_POINT_SHIFT);
+    
+    for_each_band(n_cells_y, _features->cols*_cellsize, [&](const size_t first, const size_t last) {
+        std::vector<int32_t> acc(n_bins);
+        for (size_t i = first; i < last; ++i) {
+            for (size_t j = 0; j < n_cells_x; ++j) {
+                std::fill(std::begin(acc), std::end(acc), 0);
+                for (size_t y = offset_y + i*_cellsize; y < offset_y + (i+1)*_cellsize; ++y) {
+                    const uint8_t* bins = _bins.ptr<uint8_t>(y) + offset_x + j*_cellsize;
+                    const uint16_t* mags = _mags_q.ptr<uint16_t>(y) + offset_x + j*_cellsize;
+                    for (size_t x = 0; x < _cellsize; ++x)
+                        acc[bins[x]] += mags[x];
                 }
+                HOG::TType* cell_hist = cell_hists + (i*n_cells_x + j)*n_bins;
+                for (size_t o = 0; o < n_bins; ++o)
+                    cell_hist[o] = acc[o]*scale;
             }
-            _block_norm(block_hist);
-            hog_hist.insert(std::end(hog_hist), std::begin(block_hist), std::end(block_hist));
         }
+    });
+}
+
+void HOG::compute_fhog(HOG::FeatureMap& features, const size_t phase) const {
+    
+    const int n_cells_y = static_cast<int>(features.grid_rows[phase]);
+    const int n_cells_x = static_cast<int>(features.grid_cols[phase]);
+    const size_t n_bins = cell_hist_size();
+    const HOG::TType* cell_hists = features.cell_data + features.grid_offsets[phase];
+    HOG::TType* cell_features = features.blocks.data() + features.block_offsets[phase];
+    
+    // energy of the contrast-insensitive histogram of each cell
+    HOG::THist energy(n_cells_y*n_cells_x);
+    for (int i = 0; i < n_cells_y*n_cells_x; ++i) {
+        const HOG::TType* hist = cell_hists + i*n_bins;
+        for (size_t o = 0; o < _binning; ++o)
+            energy[i] += (hist[o] + hist[o+_binning])*(hist[o] + hist[o+_binning]);
     }
-    return hog_hist;
+    // the cells outside of the grid are replaced by the closest ones
+    auto cell_energy = [&](const int y, const int x) {
+        return energy[std::min(std::max(y, 0), n_cells_y-1)*n_cells_x + std::min(std::max(x, 0), n_cells_x-1)];
+    };
+    
+    const HOG::TType truncation = 0.2;
+    for_each_band(n_cells_y, features.cols*_cellsize, [&](const size_t first, const size_t last) {
+        for (int i = first; i < static_cast<int>(last); ++i) {
+            for (int j = 0; j < n_cells_x; ++j) {
+                const HOG::TType* hist = cell_hists + (i*n_cells_x + j)*n_bins;
+                HOG::TType* feature = cell_features + (i*n_cells_x + j)*fhog_size();
+                std::fill(feature, feature + fhog_size(), 0);
+            
+                // normalizes by the 4 blocks of 2x2 cells containing the cell
+                for (int k = 0; k < 4; ++k) {
+                    const int y = i - 1 + k/2;
+                    const int x = j - 1 + k%2;
+                    const HOG::TType norm = 1 / std::sqrt(cell_energy(y, x) + cell_energy(y, x+1) + 
+                                                          cell_energy(y+1, x) + cell_energy(y+1, x+1) + epsilon);
+                    HOG::TType texture = 0;
+                    for (size_t o = 0; o < n_bins; ++o) {
+                        const HOG::TType sensitive = std::min(hist[o]*norm, truncation);
+                        feature[o] += 0.5*sensitive;
+                        texture += sensitive;
+                    }
+                    for (size_t o = 0; o < _binning; ++o)
+                        feature[n_bins + o] += 0.5*std::min((hist[o] + hist[o+_binning])*norm, truncation);
+                    feature[n_bins + _binning + k] = 0.2357*texture;
+                }
+            }
+        }
+    });
 }
 
 void HOG::magnitude_and_orientation(const cv::Mat& img) {
-    cv::Mat Dx, Dy;
-    cv::filter2D(img, Dx, CV_32F, _kernelx);
-    cv::filter2D(img, Dy, CV_32F, _kernely);
-    cv::magnitude(Dx, Dy, mag);
-    cv::phase(Dx, Dy, ori, true);
+    cv::filter2D(img, _dx, CV_32F, _kernelx);
+    cv::filter2D(img, _dy, CV_32F, _kernely);
+    cv::magnitude(_dx, _dy, mag);
+    cv::phase(_dx, _dy, ori, true);
 }
 
-const HOG::THist HOG::process_cell(const cv::Mat& cell_mag, const cv::Mat& cell_ori) {
-    HOG::THist cell_hist(_binning);
-    if(_grad_type == GRADIENT_SIGNED) {
-        for (size_t i = 0; i < cell_mag.rows; ++i) {
+void HOG::process_cell(const cv::Mat& cell_mag, const cv::Mat& cell_ori, HOG::TType* cell_hist) {
+    // FHOG always bins the signed orientation over twice the number of bins
+    const size_t n_bins = cell_hist_size();
+    const size_t bin_width = _feature_mode == FEATURE_MODE::felzenszwalb ? GRADIENT_SIGNED / n_bins : _bin_width;
+    std::fill(cell_hist, cell_hist + n_bins, 0);
+    if(_grad_type == GRADIENT_SIGNED || _feature_mode == FEATURE_MODE::felzenszwalb) {
+        for (int i = 0; i < cell_mag.rows; ++i) {
             const HOG::TType* ptr_row_mag = cell_mag.ptr<HOG::TType>(i);
             const HOG::TType* ptr_row_ori = cell_ori.ptr<HOG::TType>(i);
-            for (size_t j = 0; j < cell_mag.cols; ++j) {
-                cell_hist.at(static_cast<int>(ptr_row_ori[j] / _bin_width)) += ptr_row_mag[j];
+            for (int j = 0; j < cell_mag.cols; ++j) {
+                cell_hist[std::min(static_cast<size_t>(ptr_row_ori[j] / bin_width), n_bins-1)] += ptr_row_mag[j];
             }
         }
     } else {
-        for (size_t i = 0; i < cell_mag.rows; ++i) {
+        for (int i = 0; i < cell_mag.rows; ++i) {
             const HOG::TType* ptr_row_mag = cell_mag.ptr<HOG::TType>(i);
             const HOG::TType* ptr_row_ori = cell_ori.ptr<HOG::TType>(i);
-            for (size_t j = 0; j < cell_mag.cols; ++j) {
+            for (int j = 0; j < cell_mag.cols; ++j) {
                 HOG::TType orientation = ptr_row_ori[j];
                 if(orientation >= 180)
                     orientation -= 180;
-                cell_hist.at(static_cast<int>(orientation / _bin_width)) += ptr_row_mag[j];
+                cell_hist[std::min(static_cast<size_t>(orientation / bin_width), n_bins-1)] += ptr_row_mag[j];
             }
         }
     }
-    return cell_hist;
 }
 
 const cv::Mat HOG::get_magnitudes() {
@@ -282,111 +1310,511 @@ const cv::Mat HOG::get_orientations() {
 }
 
 const cv::Mat HOG::get_vector_mask(const int thickness) {
-    cv::Mat vector_mask = cv::Mat::zeros(mag.size(), CV_8U);
-    
-    // the maximum value of all cell histogram of the image
-    float max = 0;
+    if(!_features)
+        throw std::runtime_error("HOG::get_vector_mask(): no image has been processed!");
+    return get_vector_mask(cv::Rect(0, 0, _features->cols, _features->rows), thickness);
+}
 
-    // iterate through all cells in the image to get the local hist max value 
-    // and the max value of the entire image
-    std::vector<std::vector<float>> cell_hist_maxs(_n_cells_y);
-    for (size_t i = 0; i < _n_cells_y; ++i) {
-        cell_hist_maxs[i].resize(_n_cells_x);
-        for (size_t j = 0; j < _n_cells_x; ++j) {
-            HOG::THist cell_hist = _cell_hists[i][j];
-            HOG::TType cell_hist_max = *std::max_element(std::begin(cell_hist), std::end(cell_hist));
-            cell_hist_maxs[i][j] = cell_hist_max;
-            if(cell_hist_max > max)
-                max = cell_hist_max;
+const cv::Mat HOG::get_vector_mask(const cv::Rect& roi, const int thickness) {
+    if(!_features)
+        throw std::runtime_error("HOG::get_vector_mask(): no image has been processed!");
+    if(roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0 ||
+       roi.x + roi.width > static_cast<int>(_features->cols) || roi.y + roi.height > static_cast<int>(_features->rows))
+        throw std::runtime_error("HOG::get_vector_mask(): the ROI is outside of the image!");
+    
+    const size_t n_cells_y = _features->grid_rows[0];
+    const size_t n_cells_x = _features->grid_cols[0];
+    const size_t n_bins = cell_hist_size();
+    const size_t bin_width = _feature_mode == FEATURE_MODE::felzenszwalb ? GRADIENT_SIGNED / n_bins : _bin_width;
+    const bool is_signed = _grad_type == GRADIENT_SIGNED || _feature_mode == FEATURE_MODE::felzenszwalb;
+    const int cellsize = static_cast<int>(_cellsize);
+    const int n_lengths = cellsize/2 + 1;
+    
+    // the glyphs only depend on the parameters, they are drawn again when one changes
+    if(!_glyphs || _glyphs->cellsize != _cellsize || _glyphs->n_bins != n_bins || _glyphs->bin_width != bin_width ||
+       _glyphs->is_signed != is_signed || _glyphs->thickness != thickness) {
+        auto glyphs = std::make_shared<HOG::GlyphCache>();
+        glyphs->cellsize = _cellsize;
+        glyphs->n_bins = n_bins;
+        glyphs->bin_width = bin_width;
+        glyphs->is_signed = is_signed;
+        glyphs->thickness = thickness;
+        glyphs->margin = std::min(thickness, cellsize/2);
+        const int margin = glyphs->margin;
+        const int center = margin + cellsize/2;
+        cv::Mat canvas(cellsize + 2*margin, cellsize + 2*margin, CV_8U);
+        for (size_t k = 0; k < n_bins; ++k) {
+            for (int length = 0; length < n_lengths; ++length) {
+                canvas.setTo(cv::Scalar(0));
+                // the same "arrows" as drawn on the whole image, the center of the cell being a whole pixel
+                if(length > 0) {
+                    if(is_signed) {
+                        cv::line(canvas, cv::Point(center, center),
+                                 cv::Point(center + cos((k * bin_width) * 3.1415 / 180)*length,
+                                           center + sin((k * bin_width) * 3.1415 / 180)*length),
+                                 cv::Scalar(255), thickness);
+                    } else {
+                        cv::line(canvas, 
+                                 cv::Point(center + cos((k * bin_width+180) * 3.1415 / 180)*length,
+                                           center + sin((k * bin_width+180) * 3.1415 / 180)*length),
+                                 cv::Point(center + cos((k * bin_width) * 3.1415 / 180)*length,
+                                           center + sin((k * bin_width) * 3.1415 / 180)*length),
+                                 cv::Scalar(255), thickness);
+                    }
+                }
+                std::vector<cv::Point> pixels;
+                for (int y = 0; y < canvas.rows; ++y)
+                    for (int x = 0; x < canvas.cols; ++x)
+                        if(canvas.at<uint8_t>(y, x))
+                            pixels.push_back(cv::Point(x - margin, y - margin));
+                glyphs->glyphs.push_back(std::move(pixels));
+            }
         }
+        _glyphs = glyphs;
     }
+    const HOG::GlyphCache& glyphs = *_glyphs;
+    const int margin = glyphs.margin;
     
-    // iterate through all cells in the image
-    for (size_t i = 0; i < _n_cells_y; ++i) {
-        for (size_t j = 0; j < _n_cells_x; ++j) {
-            HOG::THist cell_hist = _cell_hists[i][j];
-
+    // the maximum value of all cell histogram of the image, so that the ROI gets the colors of the whole image
+    HOG::TType max = 0;
+    const HOG::TType* cell_data = _features->cell_data;
+    for (size_t c = 0; c < n_cells_y*n_cells_x; ++c)
+        max = std::max(max, *std::max_element(cell_data + c*n_bins, cell_data + (c + 1)*n_bins));
+    
+    cv::Mat vector_mask = cv::Mat::zeros(roi.height, roi.width, CV_8U);
+    
+    // the cells whose glyphs reach the ROI
+    const int first_y = std::max(0, (roi.y - margin)/cellsize);
+    const int last_y = std::min(static_cast<int>(n_cells_y), (roi.y + roi.height + margin + cellsize - 1)/cellsize);
+    const int first_x = std::max(0, (roi.x - margin)/cellsize);
+    const int last_x = std::min(static_cast<int>(n_cells_x), (roi.x + roi.width + margin + cellsize - 1)/cellsize);
+    
+    auto draw_row = [&](const int i) {
+        for (int j = first_x; j < last_x; ++j) {
+            const HOG::TType* cell_hist = cell_data + (i*n_cells_x + j)*n_bins;
+            const HOG::TType cell_hist_max = *std::max_element(cell_hist, cell_hist + n_bins);
+            if(cell_hist_max <= 0)
+                continue;
+            
             // the color of the lines depends uppon the local hist max and the overall max
-            int color_magnitude = static_cast<int>(cell_hist_maxs[i][j] / max * 255.0);
-
-            // iterates over the cell histogram
-            for (size_t k = 0; k < cell_hist.size(); ++k) {
-
+            const uint8_t color_magnitude = static_cast<uint8_t>(cell_hist_max / max * 255.0);
+            const int origin_x = j*cellsize - roi.x;
+            const int origin_y = i*cellsize - roi.y;
+            for (size_t k = 0; k < n_bins; ++k) {
                 // length of the "arrows"
-                int length = static_cast<int>((cell_hist[k] / cell_hist_maxs[i][j]) * _cellsize / 2);
-
-                if (length > 0 && !isinf(length)) {
-                    // draw "arrows" of varing length
-                    if(_grad_type == GRADIENT_SIGNED) {
-                        cv::line(vector_mask, cv::Point(j*_cellsize + _cellsize / 2, i*_cellsize + _cellsize / 2),
-                             cv::Point(  j*_cellsize + _cellsize / 2 + cos((k * _bin_width) * 3.1415 / 180)*length,
-                                         i*_cellsize + _cellsize / 2 + sin((k * _bin_width) * 3.1415 / 180)*length),
-                             cv::Scalar(color_magnitude, color_magnitude, color_magnitude), thickness);
-                    } else {
-                        cv::line(vector_mask, 
-                            cv::Point(  j*_cellsize + _cellsize / 2 + cos((k * _bin_width+180) * 3.1415 / 180)*length,
-                                         i*_cellsize + _cellsize / 2 + sin((k * _bin_width+180) * 3.1415 / 180)*length),
-                             cv::Point(  j*_cellsize + _cellsize / 2 + cos((k * _bin_width) * 3.1415 / 180)*length,
-                                         i*_cellsize + _cellsize / 2 + sin((k * _bin_width) * 3.1415 / 180)*length),
-                             cv::Scalar(color_magnitude, color_magnitude, color_magnitude), thickness);
+                const int length = std::min(static_cast<int>((cell_hist[k] / cell_hist_max) * _cellsize / 2), n_lengths - 1);
+                for (const auto& pixel : glyphs.glyphs[k*n_lengths + length]) {
+                    const int x = origin_x + pixel.x;
+                    const int y = origin_y + pixel.y;
+                    if(x >= 0 && y >= 0 && x < roi.width && y < roi.height) {
+                        uint8_t& value = vector_mask.at<uint8_t>(y, x);
+                        value = std::max(value, color_magnitude);
                     }
                 }
             }
-            // draw cell delimiters
-            cv::line(vector_mask, cv::Point(j*_cellsize-1, i*_cellsize-1), cv::Point(j*_cellsize + mag.rows-1, i*_cellsize-1), cv::Scalar(255, 255, 255), thickness);
-            cv::line(vector_mask, cv::Point(j*_cellsize-1, i*_cellsize-1), cv::Point(j*_cellsize-1, i*_cellsize + mag.rows-1), cv::Scalar(255, 255, 255), thickness);
         }
+    };
+    
+    // the glyphs of a row of cells spill at most cellsize/2 pixels over the next rows,
+    // so the even rows and then the odd ones can be drawn in parallel
+    const int n_rows = std::max(0, last_y - first_y);
+    for (int parity = 0; parity < 2; ++parity) {
+        pool().parallel_for((n_rows + 1 - parity)/2, [&](const size_t r, const size_t) {
+            draw_row(first_y + 2*static_cast<int>(r) + parity);
+        });
+    }
+    
+    // draw cell delimiters, once per row and column of cells
+    for (size_t i = 0; i < n_cells_y; ++i) {
+        const int y = static_cast<int>(i*_cellsize) - 1 - roi.y;
+        cv::line(vector_mask, cv::Point(-roi.x - 1, y), cv::Point(static_cast<int>(_features->cols) - roi.x, y), cv::Scalar(255), thickness);
+    }
+    for (size_t j = 0; j < n_cells_x; ++j) {
+        const int x = static_cast<int>(j*_cellsize) - 1 - roi.x;
+        cv::line(vector_mask, cv::Point(x, -roi.y - 1), cv::Point(x, static_cast<int>(_features->rows) - roi.y), cv::Scalar(255), thickness);
     }
 
     return vector_mask;
 }
 
 void HOG::clear_internals() {
-    for(auto& h1:_cell_hists) {
-        for(auto& h2:h1) 
-            h2.clear();
-        h1.clear();
-    }
-    _cell_hists.clear();
-}
-
-void HOG::save(const std::string& filename) {
-    try {
-        std::ofstream f(filename, std::ios::binary);
-        f.write( (char*)&_blocksize, sizeof(_blocksize) );
-        f.write( (char*)&_cellsize, sizeof(_cellsize) );
-        f.write( (char*)&_stride, sizeof(_stride) );
-        f.write( (char*)&_binning, sizeof(_binning) );
-        f.write( (char*)&_grad_type, sizeof(_grad_type) );
-        f.write( (char*)&_bin_width, sizeof(_bin_width) );
-        f.write( (char*)&_norm_function, sizeof(_norm_function) );
-        f.close();
-    } catch(...) {
-        throw;
-    }
-}
-
-HOG HOG::load(const std::string& filename) {
-    
-    size_t blocksize;
-    size_t cellsize;
-    size_t stride;
-    size_t grad_type;
-    size_t binning;
-    BLOCK_NORM norm_function;
-    
-    try {
-        std::ifstream f(filename, std::ios::binary);
-        f.read( (char*)&blocksize, sizeof(blocksize) );
-        f.read( (char*)&cellsize, sizeof(cellsize) );
-        f.read( (char*)&stride, sizeof(stride) );
-        f.read( (char*)&binning, sizeof(binning) );
-        f.read( (char*)&grad_type, sizeof(grad_type) );
-        f.read( (char*)&norm_function, sizeof(norm_function) );
-        f.close();
-        
-        return HOG(blocksize, cellsize, stride, binning, grad_type, norm_function);
-    } catch(...) {
-        throw;
+    // the buffers are kept for the next image unless they are shared with a copy
+    if(_features && (_features.use_count() > 1 || _features->mapping))
+        _features.reset();
+    if(_features) {
+        _features->blocks.clear();
+        _features->block_data = nullptr;
+    }
+}
+
+void HOG::set_feature_mode(const HOG::FEATURE_MODE feature_mode) {
+    _feature_mode = feature_mode;
+    _features.reset();
+    _bin_lut.reset();
+}
+
+void HOG::set_energy_threshold(const HOG::TType threshold) {
+    if(threshold < 0)
+        throw std::runtime_error("HOG::set_energy_threshold(): the threshold can't be negative!");
+    _energy_threshold = threshold;
+    _n_skipped = std::make_shared<std::atomic<size_t>>(0);
+}
+
+double HOG::window_energy(const cv::Rect& window) const {
+    check_window(window, "HOG::window_energy()");
+    if(_features->energy.empty())
+        throw std::runtime_error("HOG::window_energy(): no energy map, set an energy threshold before HOG::process()!");
+    return integral_energy(window);
+}
+
+double HOG::integral_energy(const cv::Rect& window) const {
+    size_t phase, x, y;
+    window_cells(window, phase, x, y);
+    const size_t width = window.width/_cellsize;
+    const size_t height = window.height/_cellsize;
+    const size_t stride = _features->grid_cols[phase] + 1;
+    const double* integral = _features->energy.data() + _features->energy_offsets[phase];
+    const double energy = integral[(y + height)*stride + x + width] - integral[y*stride + x + width] - 
+                          integral[(y + height)*stride + x] + integral[y*stride + x];
+    return energy/(width*height*_cellsize*_cellsize);
+}
+
+bool HOG::skip_window(const cv::Rect& window) const {
+    if(_energy_threshold <= 0 || _features->energy.empty() || integral_energy(window) >= _energy_threshold)
+        return false;
+    ++*_n_skipped;
+    return true;
+}
+
+void HOG::compute_energy(HOG::FeatureMap& features) const {
+    features.energy.clear();
+    features.energy_offsets.clear();
+    if(_energy_threshold <= 0)
+        return;
+    
+    const size_t n_grids = features.grid_rows.size();
+    size_t n_values = 0;
+    for (size_t p = 0; p < n_grids; ++p) {
+        features.energy_offsets.push_back(n_values);
+        n_values += (features.grid_rows[p] + 1)*(features.grid_cols[p] + 1);
+    }
+    features.energy_offsets.push_back(n_values);
+    features.energy.assign(n_values, 0);
+    
+    // integral[(i+1)*(n_cells_x+1) + j+1] = energy of the cells [0,i]x[0,j]
+    const size_t hist_size = cell_hist_size();
+    for (size_t p = 0; p < n_grids; ++p) {
+        const size_t n_cells_x = features.grid_cols[p];
+        const HOG::TType* cells = features.cell_data + features.grid_offsets[p];
+        double* integral = features.energy.data() + features.energy_offsets[p];
+        for (size_t i = 0; i < features.grid_rows[p]; ++i) {
+            double row_energy = 0;
+            for (size_t j = 0; j < n_cells_x; ++j) {
+                row_energy += SimdKernels::sum(cells + (i*n_cells_x + j)*hist_size, hist_size);
+                integral[(i + 1)*(n_cells_x + 1) + j + 1] = integral[i*(n_cells_x + 1) + j + 1] + row_energy;
+            }
+        }
+    }
+}
+
+const cv::Mat HOG::get_feature_map() {
+    if(_feature_mode != FEATURE_MODE::felzenszwalb)
+        throw std::runtime_error("HOG::get_feature_map(): only available in FHOG mode!");
+    if(!_features)
+        throw std::runtime_error("HOG::get_feature_map(): no image has been processed!");
+    cv::Mat feature_map(_features->grid_rows[0], _features->grid_cols[0], CV_32FC(fhog_size()));
+    std::copy(_features->block_data, _features->block_data + _features->grid_rows[0]*_features->grid_cols[0]*fhog_size(),
+              feature_map.ptr<HOG::TType>(0));
+    return feature_map;
+}
+
+void HOG::set_compute_mode(const HOG::COMPUTE_MODE compute_mode) {
+    _compute_mode = compute_mode;
+    _features.reset();
+}
+
+void HOG::set_voting(const HOG::VOTING voting) {
+    _voting = voting;
+    _features.reset();
+    _block_weights.clear();
+    if(_voting != VOTING::trilinear)
+        return;
+    // Gaussian window of the block (sigma = blocksize/2) at the center of each cell,
+    // scaled so that the cells closest to the center keep their histogram unchanged
+    const HOG::TType sigma = 0.5*_blocksize;
+    const HOG::TType center = 0.5*_blocksize;
+    for(size_t cell_y = 0; cell_y < _n_cells_per_block_y; ++cell_y) {
+        for(size_t cell_x = 0; cell_x < _n_cells_per_block_x; ++cell_x) {
+            const HOG::TType dy = (cell_y + 0.5)*_cellsize - center;
+            const HOG::TType dx = (cell_x + 0.5)*_cellsize - center;
+            _block_weights.push_back(std::exp(-(dx*dx + dy*dy)/(2*sigma*sigma)));
+        }
+    }
+    const HOG::TType max_weight = *std::max_element(std::begin(_block_weights), std::end(_block_weights));
+    for(auto& weight : _block_weights)
+        weight /= max_weight;
+}
+
+void HOG::set_phases(const size_t n_phases) {
+    if(n_phases < 1)
+        throw std::runtime_error("HOG::set_phases(): n_phases must be at least 1!");
+    if(_cellsize%n_phases != 0)
+        throw std::runtime_error("HOG::set_phases(): cellsize must be a multiple of n_phases!");
+    _n_phases = n_phases;
+    _features.reset();
+}
+
+// On-disk layout of HOG::save()/HOG::load(). All the fields are 64 bits wide
+// and written in the byte order of the machine that saved the file, which is
+// recorded by the endian tag. The histograms follow the header (and the grid
+// sizes), aligned to FILE_ALIGNMENT bytes so they can be used in place once mapped.
+// In FHOG mode the "blocks" are the per-cell FHOG features.
+// Version 2 added feature_mode at the end of the header, version 3 voting.
+static const char FILE_MAGIC[8] = {'H', 'O', 'G', 'F', 'M', 'A', 'P', '\0'};
+static const uint32_t FILE_ENDIAN_TAG = 0x01020304;
+static const uint32_t FILE_VERSION = 3;
+static const size_t FILE_ALIGNMENT = 64;
+enum FILE_FLAGS : uint64_t { FILE_HAS_CELLS = 1, FILE_HAS_BLOCKS = 2 };
+
+struct FileHeader {
+    char magic[8];
+    uint32_t endian_tag;
+    uint32_t version;
+    uint64_t blocksize;
+    uint64_t cellsize;
+    uint64_t stride;
+    uint64_t binning;
+    uint64_t grad_type;
+    uint64_t norm_function;
+    uint64_t n_phases;
+    uint64_t flags;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t cells_offset; ///< in bytes from the beginning of the file
+    uint64_t cells_count; ///< number of TType values
+    uint64_t blocks_offset;
+    uint64_t blocks_count;
+    uint64_t feature_mode;
+    uint64_t voting;
+};
+
+/// Size of the fixed part of the header of each version of the file
+static size_t header_fixed_size(const uint32_t version) {
+    if(version == 1)
+        return offsetof(FileHeader, feature_mode);
+    return version == 2 ? offsetof(FileHeader, voting) : sizeof(FileHeader);
+}
+
+static uint32_t byte_swap(uint32_t v) {
+    return ((v & 0xFF) << 24) | ((v & 0xFF00) << 8) | ((v >> 8) & 0xFF00) | (v >> 24);
+}
+
+static uint64_t byte_swap(uint64_t v) {
+    return (static_cast<uint64_t>(byte_swap(static_cast<uint32_t>(v))) << 32) | byte_swap(static_cast<uint32_t>(v >> 32));
+}
+
+static void copy_values(const char* src, const size_t count, const bool swapped, std::vector<HOG::TType>& dst) {
+    static_assert(sizeof(HOG::TType) == sizeof(uint32_t), "the file format stores 32 bits values");
+    dst.resize(count);
+    std::memcpy(dst.data(), src, count*sizeof(HOG::TType));
+    if(swapped) {
+        for(auto& v:dst) {
+            uint32_t bits;
+            std::memcpy(&bits, &v, sizeof(bits));
+            bits = byte_swap(bits);
+            std::memcpy(&v, &bits, sizeof(bits));
+        }
+    }
+}
+
+void HOG::save(const std::string& filename, const bool store_blocks) {
+    
+    FileHeader header = {};
+    std::memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    header.endian_tag = FILE_ENDIAN_TAG;
+    header.version = FILE_VERSION;
+    header.blocksize = _blocksize;
+    header.cellsize = _cellsize;
+    header.stride = _stride;
+    header.binning = _binning;
+    header.grad_type = _grad_type;
+    header.norm_function = static_cast<uint64_t>(_norm_function);
+    header.n_phases = _n_phases;
+    header.feature_mode = static_cast<uint64_t>(_feature_mode);
+    header.voting = static_cast<uint64_t>(_voting);
+    
+    // the normalized blocks at every cell position of every phase
+    HOG::THist blocks;
+    if(_features) {
+        header.flags = FILE_HAS_CELLS;
+        header.rows = _features->rows;
+        header.cols = _features->cols;
+        header.cells_count = _features->grid_offsets.back();
+        if(store_blocks && _features->block_data) {
+            // already computed: loaded from a file or FHOG features
+            blocks.assign(_features->block_data, _features->block_data + _features->block_offsets.back());
+        } else if(store_blocks) {
+            HOG::THist block_hist;
+            for(size_t p = 0; p < _features->grid_rows.size(); ++p) {
+                for(size_t block_y = 0; block_y + _n_cells_per_block_y <= _features->grid_rows[p]; ++block_y) {
+                    for(size_t block_x = 0; block_x + _n_cells_per_block_x <= _features->grid_cols[p]; ++block_x) {
+                        compute_block(p, block_y, block_x, block_hist);
+                        blocks.insert(std::end(blocks), std::begin(block_hist), std::end(block_hist));
+                    }
+                }
+            }
+        }
+        if(store_blocks) {
+            header.flags |= FILE_HAS_BLOCKS;
+            header.blocks_count = blocks.size();
+        }
+    }
+    
+    // grid sizes of each phase after the header, then the aligned histograms
+    const size_t n_grids = _n_phases*_n_phases;
+    const size_t header_size = sizeof(FileHeader) + 2*n_grids*sizeof(uint64_t);
+    auto align = [](const size_t offset) { return (offset + FILE_ALIGNMENT - 1)/FILE_ALIGNMENT*FILE_ALIGNMENT; };
+    header.cells_offset = align(header_size);
+    header.blocks_offset = align(header.cells_offset + header.cells_count*sizeof(HOG::TType));
+    
+    std::ofstream f(filename, std::ios::binary);
+    if(!f)
+        throw std::runtime_error("HOG::save(): unable to open the file " + filename + "!");
+    const char padding[FILE_ALIGNMENT] = {};
+    f.write((const char*)&header, sizeof(header));
+    for(size_t p = 0; p < n_grids; ++p) {
+        const uint64_t grid_rows = _features ? _features->grid_rows[p] : 0;
+        const uint64_t grid_cols = _features ? _features->grid_cols[p] : 0;
+        f.write((const char*)&grid_rows, sizeof(grid_rows));
+        f.write((const char*)&grid_cols, sizeof(grid_cols));
+    }
+    f.write(padding, header.cells_offset - header_size);
+    if(header.cells_count > 0)
+        f.write((const char*)_features->cell_data, header.cells_count*sizeof(HOG::TType));
+    if(header.blocks_count > 0) {
+        f.write(padding, header.blocks_offset - header.cells_offset - header.cells_count*sizeof(HOG::TType));
+        f.write((const char*)blocks.data(), header.blocks_count*sizeof(HOG::TType));
+    }
+    if(!f)
+        throw std::runtime_error("HOG::save(): error while writing the file " + filename + "!");
+}
+
+HOG HOG::load(const std::string& filename, const bool use_mmap) {
+    
+    // the content of the file, either mapped or read in memory
+    std::shared_ptr<const void> mapping;
+    std::vector<char> buffer;
+    const char* data = nullptr;
+    size_t size = 0;
+    
+#if defined(__unix__) || defined(__APPLE__)
+    if(use_mmap) {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
+            throw std::runtime_error("HOG::load(): unable to open the file " + filename + "!");
+        struct stat st;
+        if(::fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            throw std::runtime_error("HOG::load(): unable to read the file " + filename + "!");
+        }
+        size = static_cast<size_t>(st.st_size);
+        void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(addr == MAP_FAILED)
+            throw std::runtime_error("HOG::load(): unable to map the file " + filename + "!");
+        mapping = std::shared_ptr<const void>(addr, [size](const void* p) { ::munmap(const_cast<void*>(p), size); });
+        data = static_cast<const char*>(addr);
+    }
+#endif
+    if(!data) {
+        std::ifstream f(filename, std::ios::binary | std::ios::ate);
+        if(!f)
+            throw std::runtime_error("HOG::load(): unable to open the file " + filename + "!");
+        buffer.resize(static_cast<size_t>(f.tellg()));
+        f.seekg(0);
+        f.read(buffer.data(), buffer.size());
+        if(!f)
+            throw std::runtime_error("HOG::load(): unable to read the file " + filename + "!");
+        data = buffer.data();
+        size = buffer.size();
+    }
+    
+    FileHeader header = {};
+    const size_t tag_size = offsetof(FileHeader, blocksize);
+    if(size < tag_size)
+        throw std::runtime_error("HOG::load(): the file " + filename + " is truncated!");
+    std::memcpy(&header, data, tag_size);
+    if(std::memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0)
+        throw std::runtime_error("HOG::load(): " + filename + " is not a HOG file!");
+    
+    // files written on a machine with the other byte order are swapped while copied
+    const bool swapped = header.endian_tag == byte_swap(FILE_ENDIAN_TAG);
+    if(!swapped && header.endian_tag != FILE_ENDIAN_TAG)
+        throw std::runtime_error("HOG::load(): invalid endian tag in " + filename + "!");
+    const uint32_t version = swapped ? byte_swap(header.version) : header.version;
+    if(version < 1 || version > FILE_VERSION)
+        throw std::runtime_error("HOG::load(): unsupported file version " + std::to_string(version) + "!");
+    const size_t fixed_size = header_fixed_size(version);
+    if(size < fixed_size)
+        throw std::runtime_error("HOG::load(): the file " + filename + " is truncated!");
+    std::memcpy(&header, data, fixed_size);
+    if(swapped) {
+        for(uint64_t* field = &header.blocksize; field <= &header.voting; ++field)
+            *field = byte_swap(*field);
+    }
+    
+    HOG hog(header.blocksize, header.cellsize, header.stride, header.binning, header.grad_type, 
+            static_cast<BLOCK_NORM>(header.norm_function));
+    hog.set_phases(header.n_phases);
+    hog.set_feature_mode(static_cast<FEATURE_MODE>(header.feature_mode));
+    hog.set_voting(static_cast<VOTING>(header.voting));
+    if(!(header.flags & FILE_HAS_CELLS))
+        return hog;
+    
+    // checks that what follows the header matches the parameters
+    const size_t n_grids = hog._n_phases*hog._n_phases;
+    const size_t header_size = fixed_size + 2*n_grids*sizeof(uint64_t);
+    auto features = std::make_shared<HOG::FeatureMap>();
+    const size_t cells_count = hog.layout_features(*features, header.rows, header.cols);
+    bool valid = size >= header_size && header.cells_count == cells_count &&
+                 header.cells_offset % sizeof(HOG::TType) == 0 && header.blocks_offset % sizeof(HOG::TType) == 0 &&
+                 header.cells_offset + cells_count*sizeof(HOG::TType) <= size;
+    for(size_t p = 0; valid && p < n_grids; ++p) {
+        uint64_t grid_size[2];
+        std::memcpy(grid_size, data + fixed_size + 2*p*sizeof(uint64_t), sizeof(grid_size));
+        if(swapped) {
+            grid_size[0] = byte_swap(grid_size[0]);
+            grid_size[1] = byte_swap(grid_size[1]);
+        }
+        valid = grid_size[0] == features->grid_rows[p] && grid_size[1] == features->grid_cols[p];
+    }
+    if(valid && (header.flags & FILE_HAS_BLOCKS))
+        valid = header.blocks_count == features->block_offsets.back() &&
+                header.blocks_offset + header.blocks_count*sizeof(HOG::TType) <= size;
+    if(!valid)
+        throw std::runtime_error("HOG::load(): the content of " + filename + " is corrupted!");
+    
+    if(mapping && !swapped) {
+        // the histograms are used straight from the mapped pages
+        features->mapping = mapping;
+        features->cell_data = reinterpret_cast<const HOG::TType*>(data + header.cells_offset);
+        if(header.flags & FILE_HAS_BLOCKS)
+            features->block_data = reinterpret_cast<const HOG::TType*>(data + header.blocks_offset);
+    } else {
+        copy_values(data + header.cells_offset, header.cells_count, swapped, features->cells);
+        features->cell_data = features->cells.data();
+        if(header.flags & FILE_HAS_BLOCKS) {
+            copy_values(data + header.blocks_offset, header.blocks_count, swapped, features->blocks);
+            features->block_data = features->blocks.data();
+        }
+    }
+    if(hog._feature_mode == FEATURE_MODE::felzenszwalb && !features->block_data) {
+        // the FHOG features were not stored, they are computed from the cell histograms
+        features->blocks.resize(features->block_offsets.back());
+        features->block_data = features->blocks.data();
+        for(size_t p = 0; p < n_grids; ++p)
+            hog.compute_fhog(*features, p);
     }
+    hog._features = features;
+    return hog;
 }
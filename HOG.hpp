@@ -28,6 +28,9 @@
     DEALINGS IN THE SOFTWARE.
     ==========================================================================================
 */
+#ifndef HOG_HPP
+#define HOG_HPP
+
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include <iostream>
@@ -36,8 +39,14 @@
 #include <memory>
 #include <vector>
 #include <functional>
+#include <atomic>
+#include <future>
+#include <string>
+#include <cstdint>
 #include <math.h>
 
+class WorkStealingPool;
+
 class HOG {
 public:
     using TType = float;
@@ -47,6 +56,9 @@ public:
     static const size_t GRADIENT_UNSIGNED = 180;
     static constexpr TType epsilon = 1e-6;
     enum class BLOCK_NORM {none, L1norm, L1sqrt, L2norm, L2hys};
+    enum class FEATURE_MODE {dalal_triggs, felzenszwalb}; ///< block HOG (Dalal-Triggs) or per-cell FHOG
+    enum class COMPUTE_MODE {floating_point, fixed_point}; ///< arithmetic used up to the cell histograms
+    enum class VOTING {hard, trilinear}; ///< vote of a pixel: one bin of its cell, or interpolated (see HOG::set_voting())
 
     // see: https://en.wikipedia.org/wiki/Histogram_of_oriented_gradients#Block_normalization
     static void L1norm(THist& v);
@@ -71,11 +83,73 @@ private:
     std::function<void(THist&)> _block_norm; ///< function that normalize the block histogram
     const cv::Mat _kernelx = (cv::Mat_<char>(1, 3) << -1, 0, 1); ///< derivive kernel
     const cv::Mat _kernely = (cv::Mat_<char>(3, 1) << -1, 0, 1); ///< derivive kernel
-    size_t _n_cells_y;
-    size_t _n_cells_x;
+    size_t _n_phases = 1; ///< number of grid phases along each axis (see HOG::set_phases())
+    FEATURE_MODE _feature_mode = FEATURE_MODE::dalal_triggs; ///< see HOG::set_feature_mode()
+    COMPUTE_MODE _compute_mode = COMPUTE_MODE::floating_point; ///< see HOG::set_compute_mode()
+    VOTING _voting = VOTING::hard; ///< see HOG::set_voting()
+    std::vector<TType> _block_weights; ///< Gaussian weight of each cell of a block, trilinear voting only
+    TType _energy_threshold = 0; ///< see HOG::set_energy_threshold()
+    std::shared_ptr<std::atomic<size_t>> _n_skipped; ///< windows skipped for their low energy, shared between copies
+
+    /// Cell histograms of the processed image. The grids of all the phases are stored
+    /// in one contiguous buffer, [phase][cell_y][cell_x][bin], so that they can be
+    /// served either from memory or straight from a memory-mapped file (see HOG::load()).
+    struct FeatureMap {
+        size_t rows = 0; ///< height of the processed image in pixels
+        size_t cols = 0; ///< width of the processed image in pixels
+        std::vector<size_t> grid_rows; ///< number of cells along y, one per phase
+        std::vector<size_t> grid_cols; ///< number of cells along x, one per phase
+        std::vector<size_t> grid_offsets; ///< offset of each grid in cell_data, plus the total size
+        std::vector<size_t> block_offsets; ///< offset of each grid of blocks in block_data, plus the total size
+        std::vector<TType> cells; ///< storage of the cell histograms when not mapped
+        std::vector<TType> blocks; ///< storage of the normalized blocks (or FHOG cell features) when not mapped
+        std::shared_ptr<const void> mapping; ///< keeps the memory-mapped file alive
+        const TType* cell_data = nullptr; ///< points to cells or into the mapping
+        const TType* block_data = nullptr; ///< normalized blocks, only available when loaded from file.
+                                           ///< In FHOG mode the dense per-cell feature map, always available
+        std::vector<double> energy; ///< integral images of the cell energies (sums of the histograms), one per phase
+        std::vector<size_t> energy_offsets; ///< offset of each integral image in energy
+    };
+    std::shared_ptr<FeatureMap> _features; ///< shared between copies, never modified once computed
+
+public:
+    /// Linear model of a window (score = bias + weights * HOG) split in stages of blocks.
+    /// The blocks of a window are numbered as in HOG::retrieve(), row by row.
+    struct Cascade {
+        THist weights; ///< one weight per value of the window's HOG
+        TType bias = 0;
+        std::vector<std::vector<size_t>> stages; ///< blocks added to the score by each stage, in order
+        std::vector<TType> thresholds; ///< a window is rejected when its score after stage i is below thresholds[i]
+    };
+
+    /// Counters of HOG::detect()
+    struct CascadeStats {
+        size_t n_windows = 0; ///< windows of the scan
+        size_t n_rejected = 0; ///< windows rejected by one of the stages
+        size_t n_blocks = 0; ///< blocks built and normalized (0 if they were loaded with the feature map)
+        size_t n_skipped = 0; ///< windows skipped for their low energy before the stages, not in n_rejected (see HOG::set_energy_threshold())
+    };
+
+private:
 
     cv::Mat mag, ori;
-    std::vector<std::vector<THist>> _cell_hists;
+    cv::Mat _dx, _dy; ///< gradient images, kept to reuse their buffers
+    cv::Mat _bins, _mags_q; ///< per-pixel bin (CV_8U) and fixed-point magnitude (CV_16U) in fixed-point mode
+    std::shared_ptr<const std::vector<uint8_t>> _bin_lut; ///< bin of each (dx,dy) gradient in fixed-point mode
+    std::shared_ptr<WorkStealingPool> _pool; ///< threads shared between copies, WorkStealingPool::default_pool() if not set
+
+    /// Glyphs of HOG::get_vector_mask(): the pixels of the line of each bin at each length,
+    /// relative to the top-left corner of the cell, for one cellsize, binning and thickness
+    struct GlyphCache {
+        size_t cellsize = 0;
+        size_t n_bins = 0;
+        size_t bin_width = 0;
+        bool is_signed = false;
+        int thickness = 0;
+        int margin = 0; ///< pixels drawn around the cell, at most cellsize/2
+        std::vector<std::vector<cv::Point>> glyphs; ///< [bin*(cellsize/2 + 1) + length]
+    };
+    std::shared_ptr<const GlyphCache> _glyphs; ///< built on the first call of HOG::get_vector_mask()
 
 public:
     HOG();
@@ -95,6 +169,9 @@ public:
     // assignment operator
     HOG& operator=(const HOG& to_copy);
 
+    // Move constructor, used to hand over the results of HOG::process_async()
+    HOG(HOG&& to_move) = default;
+
     /// Extracts an histogram of gradients for each cell in the image.
     /// Then, using HOG::retrieve() one can get the HOG of an image's ROI.
     ///
@@ -108,6 +185,315 @@ public:
     /// @return the HOG histogram as std::vector
     const THist retrieve(const cv::Rect& window);
 
+    /// Number of values of the HOG of a window of a given size
+    ///
+    /// @param window: size of the window in pixels
+    /// @return the size of the histogram returned by HOG::retrieve()
+    size_t descriptor_size(const cv::Size& window) const;
+
+    /// Number of values of each normalized block of the HOG (of each cell in FHOG mode),
+    /// e.g. the size of the sub-vectors of a ProductQuantizer
+    size_t block_hist_size() const {
+        return _feature_mode == FEATURE_MODE::felzenszwalb ? fhog_size() : _block_hist_size;
+    }
+
+    /// Computes the HOG of many small images at once (e.g. crops of 64x128).
+    /// The crops are spread over the threads of the pool (see HOG::set_num_threads())
+    /// with work stealing, so crops of different sizes still balance. Each thread
+    /// reuses one HOG object, and its buffers, for all the crops it processes.
+    ///
+    /// @param crops: the images, they must have the same number of cells
+    /// @return one row per crop with its HOG (the whole crop as window), CV_32F
+    cv::Mat process_batch(const std::vector<cv::Mat>& crops);
+
+    /// Exponent of the power law used by HOG::process_pyramid() to extrapolate the cell
+    /// histograms across scales: the mean gradient energy of an image downsampled by a
+    /// factor s < 1 is about s^-lambda times the one of the original (Dollar et al.,
+    /// "Fast Feature Pyramids for Object Detection"), lambda ~ 0.1 on natural images.
+    /// The gain is the same for all the cells of a level, so it mostly cancels out in the
+    /// normalized blocks and FHOG features; it matters for the cell histograms and BLOCK_NORM::none.
+    static constexpr TType pyramid_lambda = 0.1;
+
+    /// Computes the HOG of an image at the scales 2^(-i/levels_per_octave), down to the
+    /// smallest scale where the image is still as big as min_size. Only real_per_octave
+    /// levels per octave are processed from a resized image (the first one being the image
+    /// itself); the other levels are resampled from the cell histograms of the closest finer
+    /// real level (bilinear interpolation of the cell centers) times (s/s_real)^-lambda.
+    /// Each level can be used like a processed object, with windows in its coordinates.
+    /// The real levels, then the resampled ones, are spread over the threads of the pool.
+    ///
+    /// @param img: source image (any size)
+    /// @param min_size: size of the smallest level, e.g. the detection window
+    /// @param levels_per_octave: number of levels per halving of the image size
+    /// @param real_per_octave: number of processed levels per octave, a divisor of
+    ///                         levels_per_octave (= levels_per_octave for an exact pyramid)
+    /// @param scales: ref. to the vector where to store the scale of each level
+    /// @param lambda: exponent of the power law
+    /// @return one HOG object per level, from the largest
+    std::vector<HOG> process_pyramid(const cv::Mat& img, const cv::Size& min_size, const size_t levels_per_octave, 
+                                     const size_t real_per_octave, std::vector<double>& scales, 
+                                     const TType lambda = pyramid_lambda) const;
+
+    /// Retrieves the HOG of all the windows of a sliding window scan of the processed image.
+    /// The windows are grouped in tiles of neighbouring windows, so that the cells they
+    /// read stay in cache, and the tiles are spread over the threads of the pool with
+    /// work stealing. The output rows are ordered tile by tile.
+    ///
+    /// @param window: size of the windows in pixels
+    /// @param stride: step between two windows in pixels
+    /// @param windows: ref. to the vector where to store the window of each output row
+    /// @return one row per window with its HOG, CV_32F
+    cv::Mat scan(const cv::Size& window, const size_t stride, std::vector<cv::Rect>& windows) const;
+
+    /// Function receiving the HOG of a tile of windows, one row per window
+    using ScanConsumer = std::function<void(const cv::Mat& descriptors, const cv::Rect* windows)>;
+
+    /// Same as above but without storing all the descriptors: each thread fills a slab
+    /// with the HOG of one tile at a time and passes it to the consumer. The consumer
+    /// is called concurrently by the threads of the pool and the slab is reused after
+    /// it returns.
+    ///
+    /// @param window: size of the windows in pixels
+    /// @param stride: step between two windows in pixels
+    /// @param consume: function called with the HOG of each tile
+    /// @return none
+    void scan(const cv::Size& window, const size_t stride, const ScanConsumer& consume) const;
+
+    /// Retrieves the HOG of many windows at once on the threads of the pool
+    ///
+    /// @param windows: image's ROIs/windows in pixels, they must have the same number of cells
+    /// @return one row per window with its HOG, CV_32F
+    cv::Mat retrieve_batch(const std::vector<cv::Rect>& windows) const;
+
+    /// Builds a cascade from a linear model: the blocks are ordered by the norm of their
+    /// weights and split in stages doubling in size. The thresholds don't reject
+    /// anything until they are set, e.g. by HOG::learn_thresholds().
+    ///
+    /// @param weights: one weight per value of the HOG of the window
+    /// @param bias: bias of the model
+    /// @param window: size of the windows in pixels
+    /// @param n_stages: number of stages
+    /// @return the cascade
+    Cascade make_cascade(const THist& weights, const TType bias, const cv::Size& window, const size_t n_stages) const;
+
+    /// Sets the thresholds of a cascade from the HOG of positive windows: each stage
+    /// keeps the fraction "recall" of the positives accepted by the previous stages.
+    ///
+    /// @param cascade: ref. to the cascade to update
+    /// @param positives: one row per positive window with its HOG (e.g. from HOG::retrieve_batch())
+    /// @param recall: fraction of the positives kept by each stage, 1 keeps them all
+    /// @return none
+    void learn_thresholds(Cascade& cascade, const cv::Mat& positives, const TType recall = 1) const;
+
+    /// Scores a window with a cascade, building only the blocks needed until a stage rejects it
+    ///
+    /// @param window: image's ROI/widnow in pixels
+    /// @param cascade: the model
+    /// @param score: ref. to the score of the window (the partial one if rejected)
+    /// @return true if the window passes all the stages
+    bool cascade_score(const cv::Rect& window, const Cascade& cascade, TType& score) const;
+
+    /// Scores all the windows of a sliding window scan with a cascade (see HOG::scan()).
+    ///
+    /// @param window: size of the windows in pixels
+    /// @param stride: step between two windows in pixels
+    /// @param cascade: the model
+    /// @param scores: ref. to the vector where to store the score of each detection
+    /// @param stats: optional pointer where to store the counters of the scan
+    /// @return the windows that pass all the stages
+    std::vector<cv::Rect> detect(const cv::Size& window, const size_t stride, const Cascade& cascade, 
+                                 std::vector<TType>& scores, CascadeStats* stats = nullptr) const;
+
+    /// Function filling "rows" with the rows of an image starting at row y. The matrix is
+    /// already allocated with the width, type and number of rows to read: it must be filled
+    /// (e.g. with copyTo()) and not reallocated.
+    using RowReader = std::function<void(const size_t y, cv::Mat& rows)>;
+
+    /// Function receiving the HOG of the windows of a band, one row per window
+    using BandConsumer = std::function<void(const cv::Mat& descriptors, const std::vector<cv::Rect>& windows)>;
+
+    /// Function receiving the detections of a band and their scores
+    using DetectionConsumer = std::function<void(const std::vector<cv::Rect>& detections, const std::vector<TType>& scores)>;
+
+    /// Row reader of an image in memory, for HOG::stream() and HOG::stream_detect().
+    /// Unlike HOG::process(), the pixels around an image that is a ROI are not used.
+    ///
+    /// @param img: the image
+    /// @return function copying the rows of the image
+    static RowReader mat_reader(const cv::Mat& img);
+
+    /// Sliding window scan of an image too big to be held in memory. The image is read in
+    /// horizontal bands of rows, each band is processed and the HOG of its windows
+    /// are passed to the consumer, band after band from the top. Only the rows of one
+    /// band are kept in memory (the rows shared with the next band are kept, not read
+    /// twice), so the memory depends on the band height and the width, not on the height
+    /// of the image. The windows get the same HOG as with HOG::process() and HOG::retrieve().
+    ///
+    /// @param image_size: size of the whole image
+    /// @param type: type of the image
+    /// @param read: function reading the rows of the image
+    /// @param window: size of the windows in pixels
+    /// @param stride: step between two windows in pixels
+    /// @param band_height: number of image rows per band, at least the window height
+    ///                     (rounded so that the bands start on a cell boundary)
+    /// @param consume: function called with the HOG of the windows of each band
+    /// @return none
+    void stream(const cv::Size& image_size, const int type, const RowReader& read, const cv::Size& window,
+                const size_t stride, const size_t band_height, const BandConsumer& consume) const;
+
+    /// Same as HOG::stream() but the windows are scored with a cascade (see HOG::detect())
+    ///
+    /// @param image_size: size of the whole image
+    /// @param type: type of the image
+    /// @param read: function reading the rows of the image
+    /// @param window: size of the windows in pixels
+    /// @param stride: step between two windows in pixels
+    /// @param band_height: number of image rows per band, at least the window height
+    /// @param cascade: the model
+    /// @param consume: function called with the detections of each band
+    /// @param stats: optional pointer where to store the counters of the whole image
+    /// @return none
+    void stream_detect(const cv::Size& image_size, const int type, const RowReader& read, const cv::Size& window,
+                       const size_t stride, const size_t band_height, const Cascade& cascade, 
+                       const DetectionConsumer& consume, CascadeStats* stats = nullptr) const;
+
+    /// Function called by HOG::process_async() with the processed object
+    using ProcessCallback = std::function<void(const HOG& hog)>;
+
+    /// Function called by HOG::retrieve_async() with the HOG of the windows
+    using RetrieveCallback = std::function<void(const cv::Mat& descriptors, const std::vector<cv::Rect>& windows)>;
+
+    /// Same as HOG::process() but runs on the pool and returns immediately.
+    /// The image's pixels are shared, not copied: they must not be modified before
+    /// the task is done. This object is neither modified nor needed by the task.
+    ///
+    /// @param img: source image (any size)
+    /// @param on_done: optional function called on the pool once the image is processed
+    /// @return future of a copy of this object holding the processed image,
+    ///         or of the exception thrown by HOG::process()
+    std::future<HOG> process_async(const cv::Mat& img, const ProcessCallback& on_done = nullptr) const;
+
+    /// Same as HOG::retrieve_batch() but runs on the pool and returns immediately.
+    /// The task shares the feature map of the processed image, so this object can
+    /// process the next image in the meantime.
+    ///
+    /// @param windows: image's ROIs/windows in pixels, they must have the same number of cells
+    /// @param on_done: optional function called on the pool once the HOG are retrieved
+    /// @return future of the descriptors, one row per window
+    std::future<cv::Mat> retrieve_async(const std::vector<cv::Rect>& windows, const RetrieveCallback& on_done = nullptr) const;
+
+    /// Sets the number of threads used by this object (and its copies) in the
+    /// batch, scan and asynchronous functions. By default a pool shared by the
+    /// whole process is used.
+    ///
+    /// @param n_threads: number of worker threads (0 = one per hardware thread)
+    /// @return none
+    void set_num_threads(const size_t n_threads);
+
+    /// Sets the pool used by this object (and its copies), e.g. to share one
+    /// fixed pool between several objects (see StreamScheduler)
+    ///
+    /// @param pool: the pool, nullptr for the default one
+    /// @return none
+    void set_pool(const std::shared_ptr<WorkStealingPool>& pool);
+
+    /// Sets the number of phase-shifted cell grids computed by HOG::process().
+    /// With n_phases=k the cell grid is also computed at the k*k offsets
+    /// (cellsize/k)*(i,j), so that HOG::retrieve() can serve windows placed at
+    /// any multiple of cellsize/k instead of only at multiples of cellsize.
+    /// All the grids share the same magnitude and orientation images.
+    ///
+    /// @param n_phases: number of phases along each axis (1 = cell aligned only)
+    /// @return none
+    void set_phases(const size_t n_phases);
+
+    /// Selects the descriptor computed by HOG::process() and HOG::retrieve().
+    ///
+    /// FEATURE_MODE::dalal_triggs (default) is the block-normalized HOG.
+    /// FEATURE_MODE::felzenszwalb is the FHOG variant of Felzenszwalb et al. (used by
+    /// DPM and KCF): the cells are binned over 2*binning signed orientations, then each
+    /// cell gets 2*binning contrast-sensitive + binning contrast-insensitive features
+    /// truncated over the 4 neighbouring 2x2-cell blocks, plus 4 texture energies
+    /// (31 values per cell with binning=9). The blocksize, stride, grad_type and
+    /// block norm are not used in this mode, and HOG::retrieve() returns the
+    /// features of the window's cells in row-major order.
+    ///
+    /// @param feature_mode: the descriptor to compute
+    /// @return none
+    void set_feature_mode(const FEATURE_MODE feature_mode);
+
+    /// Selects the arithmetic used by HOG::process() for CV_8U single channel images.
+    ///
+    /// COMPUTE_MODE::fixed_point computes the gradients in int16, gets the bin of each
+    /// pixel from a lookup table indexed by (dx,dy) and its magnitude in Q4 fixed point
+    /// (1/16) from a square root table, and accumulates the cells in int32. The cell
+    /// histograms are converted to float once per cell, before block normalization.
+    /// Maximum error against COMPUTE_MODE::floating_point: the magnitude of each pixel
+    /// is rounded to 1/32, so each bin of a cell differs by at most cellsize*cellsize/32;
+    /// the bins are taken from the exact angle while cv::phase() is accurate to about
+    /// 0.3 degree, so pixels within that distance of a bin boundary may be binned
+    /// differently. Other image types always use the floating point path.
+    /// The magnitude and orientation images are not computed in this mode.
+    ///
+    /// @param compute_mode: the arithmetic to use
+    /// @return none
+    void set_compute_mode(const COMPUTE_MODE compute_mode);
+
+    /// Selects how HOG::process() votes the magnitude of each pixel.
+    ///
+    /// VOTING::hard gives the whole magnitude to one bin of the cell of the pixel.
+    /// VOTING::trilinear (Dalal-Triggs) splits it linearly between the 2 closest bins
+    /// and bilinearly between the 4 cells whose centers surround the pixel, so that the
+    /// descriptors change smoothly when the window moves and coarser strides can be scanned.
+    /// The weights of the pixel positions in a cell are tabulated once per pass and the
+    /// votes of a row of pixels are accumulated before being split between two rows of cells.
+    /// Approximations: the cells are shared by all the blocks, so a pixel votes in the
+    /// cells next to its own even if they belong to another block, and the Gaussian
+    /// window of the block (sigma = blocksize/2) weights whole cells by their center
+    /// instead of each pixel. With 2x2 cells per block all the weights are equal to 1.
+    /// Always computed in floating point.
+    ///
+    /// @param voting: the voting to use
+    /// @return none
+    void set_voting(const VOTING voting);
+
+    /// The voting used by HOG::process() (see HOG::set_voting())
+    VOTING get_voting() const {
+        return _voting;
+    }
+
+    /// Sets the energy under which the windows of the dense functions are skipped.
+    ///
+    /// With a threshold > 0, HOG::process() also sums each cell histogram (the gradient
+    /// energy of the cell) in an integral image per phase, so that the energy of any
+    /// window costs 4 reads. HOG::scan(), HOG::retrieve_batch(), HOG::stream(), HOG::detect()
+    /// and HOG::stream_detect() then skip the windows whose mean energy per pixel is under
+    /// the threshold: their descriptor is all zeros and they are never detections.
+    /// HOG::retrieve() and HOG::cascade_score() always compute the window.
+    /// Takes effect from the next processed image.
+    ///
+    /// @param threshold: mean gradient magnitude per pixel of a window under which it is skipped (0 = never)
+    /// @return none
+    void set_energy_threshold(const TType threshold);
+
+    /// Mean energy (gradient magnitude) per pixel of the cells of a window, in O(1)
+    /// (needs HOG::set_energy_threshold() before HOG::process())
+    ///
+    /// @param window: image's ROI/window in pixels
+    /// @return sum of the cell histograms of the window divided by its number of pixels
+    double window_energy(const cv::Rect& window) const;
+
+    /// Number of windows skipped by the dense functions since HOG::set_energy_threshold(),
+    /// by this object and its copies
+    size_t skipped_windows() const {
+        return _n_skipped ? _n_skipped->load() : 0;
+    }
+
+    /// Retrieves the dense FHOG feature map of the cell-aligned grid (FHOG mode only)
+    ///
+    /// @return matrix of n_cells_y x n_cells_x with 3*binning+4 channels CV_32F
+    const cv::Mat get_feature_map();
+
 private:
     /// Retrieves magnitude and orientation form an image
     ///
@@ -117,12 +503,199 @@ private:
     /// @return none
     void magnitude_and_orientation(const cv::Mat& img);
 
+    /// Retrieves the bin and fixed-point magnitude of each pixel of a CV_8U image
+    /// (fixed-point mode), stored in _bins and _mags_q
+    ///
+    /// @param img: source image CV_8U (any size)
+    /// @return none
+    void bins_and_magnitudes_fixed(const cv::Mat& img);
+
+    /// Computes the grid of cell histograms of one phase from _bins and _mags_q
+    ///
+    /// @param phase: index of the phase (phase_y*n_phases + phase_x)
+    /// @param offset_y: vertical offset of the grid in pixels
+    /// @param offset_x: horizontal offset of the grid in pixels
+    /// @return none
+    void process_grid_fixed(const size_t phase, const size_t offset_y, const size_t offset_x);
+
     /// Iterates over a cell to create the cell histogram
     ///
     /// @param cell_mag: a portion of a block (cell) of the magnitude matrix
     /// @param cell_ori: a portion of a block (cell) of the orientation matrix
-    /// @return the cell histogram as std::vector
-    const THist process_cell(const cv::Mat& cell_mag, const cv::Mat& cell_ori);
+    /// @param cell_hist: pointer to the _binning values where to store the cell histogram
+    /// @return none
+    void process_cell(const cv::Mat& cell_mag, const cv::Mat& cell_ori, TType* cell_hist);
+
+    /// Computes the grid of cell histograms of one phase
+    ///
+    /// @param phase: index of the phase (phase_y*n_phases + phase_x)
+    /// @param offset_y: vertical offset of the grid in pixels
+    /// @param offset_x: horizontal offset of the grid in pixels
+    /// @return none
+    void process_grid(const size_t phase, const size_t offset_y, const size_t offset_x);
+
+    /// Computes the grid of cell histograms of one phase with trilinear voting (see HOG::set_voting())
+    ///
+    /// @param phase: index of the phase (phase_y*n_phases + phase_x)
+    /// @param offset_y: vertical offset of the grid in pixels
+    /// @param offset_x: horizontal offset of the grid in pixels
+    /// @return none
+    void process_grid_trilinear(const size_t phase, const size_t offset_y, const size_t offset_x);
+
+    /// Computes the layout (grid sizes and offsets) of the feature map for an image
+    ///
+    /// @param features: the feature map to set up
+    /// @param rows: height of the image in pixels
+    /// @param cols: width of the image in pixels
+    /// @return the number of values of all the cell grids
+    size_t layout_features(FeatureMap& features, const size_t rows, const size_t cols) const;
+
+    /// Concatenates and normalizes the cell histograms of a block
+    ///
+    /// @param phase: index of the phase of the grid
+    /// @param block_y: vertical position of the block in cells
+    /// @param block_x: horizontal position of the block in cells
+    /// @param block_hist: ref. to the histogram where to store the normalized block
+    /// @return none
+    void compute_block(const size_t phase, const size_t block_y, const size_t block_x, THist& block_hist) const;
+
+    /// Position of a window in the cell grids
+    ///
+    /// @param window: image's ROI/widnow in pixels
+    /// @param phase: ref. to the phase-shifted grid of the window
+    /// @param x: ref. to the first column of cells of the window in the grid
+    /// @param y: ref. to the first row of cells of the window in the grid
+    /// @return none
+    void window_cells(const cv::Rect& window, size_t& phase, size_t& x, size_t& y) const;
+
+    /// A normalized block, either loaded with the feature map or computed in a scratch histogram
+    ///
+    /// @param phase: phase-shifted grid
+    /// @param block_y: row of the block's first cell
+    /// @param block_x: column of the block's first cell
+    /// @param block_hist: ref. to the scratch histogram
+    /// @return pointer to the _block_hist_size values of the block
+    const TType* block_at(const size_t phase, const size_t block_y, const size_t block_x, THist& block_hist) const;
+
+    /// Checks that a cascade fits the windows of a given size
+    void check_cascade(const Cascade& cascade, const cv::Size& window, const std::string& caller) const;
+
+    /// HOG::detect() on a list of windows grouped in tiles
+    ///
+    /// @param windows: the windows, inside the processed image
+    /// @param first_row: index of the first window of each tile, followed by the number of windows
+    /// @param cascade: the model
+    /// @param scores: ref. to the vector where to store the score of each detection
+    /// @param stats: optional pointer where to store the counters
+    /// @return the windows that pass all the stages
+    std::vector<cv::Rect> detect_tiles(const std::vector<cv::Rect>& windows, const std::vector<size_t>& first_row, 
+                                       const Cascade& cascade, std::vector<TType>& scores, CascadeStats* stats) const;
+
+    /// Reads an image band by band and processes each band (see HOG::stream())
+    ///
+    /// @param process_band: function called with the processed band, the windows of the
+    ///                      band in its coordinates and the first row of the band in the image
+    void stream_bands(const cv::Size& image_size, const int type, const RowReader& read, const cv::Size& window,
+                      const size_t stride, const size_t band_height, const std::string& caller,
+                      const std::function<void(const HOG&, const std::vector<cv::Rect>&, const size_t)>& process_band) const;
+
+    /// HOG::cascade_score() without the checks, counting the normalized blocks
+    bool cascade_score(const cv::Rect& window, const Cascade& cascade, TType& score, 
+                       THist& block_hist, size_t& n_blocks) const;
+
+    /// Writes the HOG of a window, already checked to be inside the image
+    ///
+    /// @param window: image's ROI/widnow in pixels
+    /// @param hog_hist: pointer to the descriptor_size() values where to store the HOG
+    /// @param block_hist: ref. to a scratch histogram for the blocks
+    /// @return none
+    void retrieve_into(const cv::Rect& window, TType* hog_hist, THist& block_hist) const;
+
+    /// Checks that an image has been processed and that the window is inside of it
+    ///
+    /// @param window: image's ROI/widnow in pixels
+    /// @param caller: name of the calling function for the error messages
+    /// @return none
+    void check_window(const cv::Rect& window, const std::string& caller) const;
+
+    /// Copy of the parameters only, used for the per-thread objects of the batch functions
+    ///
+    /// @return HOG object with the same parameters and no processed image
+    HOG worker_copy() const;
+
+    /// Checks the arguments of HOG::scan() and lists the windows of the scan tile by tile
+    ///
+    /// @param window: size of the windows in pixels
+    /// @param stride: step between two windows in pixels
+    /// @param windows: ref. to the vector where to store the windows
+    /// @return the index of the first window of each tile, followed by the number of windows
+    std::vector<size_t> scan_tiles(const cv::Size& window, const size_t stride, std::vector<cv::Rect>& windows) const;
+
+    /// Fills the feature map of a pyramid level by resampling the cells of a real level
+    ///
+    /// @param real: the processed level
+    /// @param ratio: scale of this level relative to the real one, below 1
+    /// @param size: size of this level in pixels
+    /// @param lambda: exponent of the power law (see HOG::process_pyramid())
+    /// @return none
+    void approximate_level(const HOG& real, const double ratio, const cv::Size& size, const TType lambda);
+
+    /// Copy of the parameters and of the feature map, without the gradient images
+    ///
+    /// @return HOG object sharing the feature map of this object
+    HOG shallow_copy() const;
+
+    /// The pool used by the batch functions
+    ///
+    /// @return the pool of this object, or the default one
+    WorkStealingPool& pool() const;
+
+    /// Calls a function on bands of rows on the pool, or once on all the rows
+    /// when they hold too few pixels to be worth several tasks
+    ///
+    /// @param n_rows: number of rows
+    /// @param row_pixels: number of pixels of a row
+    /// @param body: function called with the first and the past-the-end row of a band
+    /// @return none
+    void for_each_band(const size_t n_rows, const size_t row_pixels, const std::function<void(const size_t, const size_t)>& body) const;
+
+    /// Computes the FHOG features of all the cells of a grid from its signed cell histograms
+    ///
+    /// @param features: the feature map holding the cell histograms and where to store the features
+    /// @param phase: index of the phase of the grid
+    /// @return none
+    void compute_fhog(FeatureMap& features, const size_t phase) const;
+
+    /// Computes the integral images of the cell energies of all the phases, if an
+    /// energy threshold is set (see HOG::set_energy_threshold())
+    ///
+    /// @param features: the feature map holding the cell histograms and where to store the integral images
+    /// @return none
+    void compute_energy(FeatureMap& features) const;
+
+    /// Mean energy per pixel of a window from the integral images, without any check
+    /// (the window is in the image and the energy map is computed)
+    ///
+    /// @param window: image's ROI/window in pixels
+    /// @return sum of the cell histograms of the window divided by its number of pixels
+    double integral_energy(const cv::Rect& window) const;
+
+    /// Whether a window of a dense function is skipped for its low energy; counts it if so.
+    /// The window must have been checked by the caller.
+    ///
+    /// @param window: image's ROI/window in pixels
+    /// @return true if the window is under the energy threshold
+    bool skip_window(const cv::Rect& window) const;
+
+    /// Number of values of each cell histogram (2*binning signed bins in FHOG mode)
+    size_t cell_hist_size() const {
+        return _feature_mode == FEATURE_MODE::felzenszwalb ? 2*_binning : _binning;
+    }
+
+    /// Number of FHOG features of each cell
+    size_t fhog_size() const {
+        return 3*_binning + 4;
+    }
 
     /// Clear internal/local data
     ///
@@ -143,16 +716,46 @@ public:
 
     /// Utility funtion to retreve a mask of vectors
     ///
-    /// @return the vector matrix CV_32F
+    /// Each cell of the cell-aligned grid gets one line per bin, as long as the bin relative
+    /// to the largest bin of the cell and as bright as the largest bin relative to the largest
+    /// of the image, over a grid of the cells. The lines are blitted from glyphs drawn once
+    /// per bin and length for the current parameters, and the rows of cells are spread over
+    /// the threads of the pool.
+    ///
+    /// @param thickness: thickness of the lines in pixels
+    /// @return the vector matrix CV_8U
     const cv::Mat get_vector_mask(const int thickness = 1);
 
+    /// Same as above but only the pixels of a ROI are drawn, e.g. for a live overlay
+    ///
+    /// @param roi: ROI of the processed image in pixels
+    /// @param thickness: thickness of the lines in pixels
+    /// @return the vector matrix of the ROI CV_8U, equal to get_vector_mask(thickness)(roi)
+    const cv::Mat get_vector_mask(const cv::Rect& roi, const int thickness = 1);
+
     /// Save the HOG object
+    ///
+    /// The file is a versioned, endian-tagged binary holding the parameters and,
+    /// if an image has been processed, the cell histograms of all the phases.
+    /// Optionally the normalized blocks are stored too, so that HOG::retrieve()
+    /// on the loaded object doesn't need to normalize them again.
+    ///
     /// @param filename: name of the file where to store the object
+    /// @param store_blocks: if true, the normalized blocks are saved as well
     /// @return none
-    void save(const std::string& filename);
+    void save(const std::string& filename, const bool store_blocks = false);
 
     /// Load the HOG object
+    ///
+    /// When the file was saved after HOG::process(), the loaded object can be used
+    /// with HOG::retrieve() straight away. With use_mmap the file is memory-mapped
+    /// and the histograms are read from the mapped pages without any copy (files
+    /// with the other endianness are copied and byte-swapped instead).
+    ///
     /// @param filename: name of the file where to retrieve the object
+    /// @param use_mmap: if true, memory-map the file instead of reading it
     /// @return HOG object
-    static HOG load(const std::string& filename);
+    static HOG load(const std::string& filename, const bool use_mmap = false);
 };
+
+#endif
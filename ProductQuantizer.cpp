@@ -0,0 +1,276 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: ProductQuantizer.cpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Product quantization of HOG descriptors block by block, with
+                    nearest neighbour search by asymmetric distance.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#include "ProductQuantizer.hpp"
+#include "WorkStealingPool.hpp"
+#include "SimdKernels.hpp"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+
+static const char FILE_MAGIC[8] = {'H', 'O', 'G', 'P', 'Q', '\0', '\0', '\0'};
+static const uint32_t FILE_ENDIAN_TAG = 0x01020304;
+static const uint32_t FILE_VERSION = 1;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t endian_tag;
+    uint32_t version;
+    uint64_t n_blocks;
+    uint64_t block_size;
+    uint64_t n_centroids;
+};
+
+// number of codes scored at once by search(), so that the lookup table stays in cache
+static const size_t SEARCH_CHUNK = 4096;
+
+void ProductQuantizer::check_size(const size_t size, const std::string& caller) const {
+    if(_n_blocks == 0)
+        throw std::runtime_error("ProductQuantizer::" + caller + "(): the quantizer is not trained!");
+    if(size != _n_blocks*_block_size)
+        throw std::runtime_error("ProductQuantizer::" + caller + "(): the descriptors don't have the size of the codebooks!");
+}
+
+void ProductQuantizer::train(const cv::Mat& descriptors, const size_t block_size, const size_t n_centroids,
+                             const size_t n_iterations) {
+    
+    if(descriptors.type() != CV_32F || descriptors.empty())
+        throw std::runtime_error("ProductQuantizer::train(): the descriptors must be a non-empty CV_32F matrix!");
+    if(block_size == 0 || descriptors.cols % block_size != 0)
+        throw std::runtime_error("ProductQuantizer::train(): the descriptor size must be a multiple of block_size!");
+    if(n_centroids == 0 || n_centroids > MAX_CENTROIDS)
+        throw std::runtime_error("ProductQuantizer::train(): n_centroids must be in [1, 256]!");
+    
+    _n_blocks = descriptors.cols/block_size;
+    _block_size = block_size;
+    _n_centroids = std::min(n_centroids, static_cast<size_t>(descriptors.rows));
+    _centroids.assign(_n_blocks*_n_centroids*_block_size, 0);
+    _centroid_norms.resize(_n_blocks*_n_centroids);
+    
+    // the codebooks are independent, one k-means per block position
+    WorkStealingPool::default_pool()->parallel_for(_n_blocks, [&](const size_t b, const size_t) {
+        cv::Mat blocks = descriptors.colRange(b*_block_size, (b + 1)*_block_size).clone();
+        cv::Mat labels, centers;
+        cv::kmeans(blocks, _n_centroids, labels, 
+                   cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, n_iterations, 1e-4), 
+                   1, cv::KMEANS_PP_CENTERS, centers);
+        for(size_t c = 0; c < _n_centroids; ++c) {
+            const float* center = centers.ptr<float>(c);
+            std::copy(center, center + _block_size, &_centroids[(b*_n_centroids + c)*_block_size]);
+            _centroid_norms[b*_n_centroids + c] = SimdKernels::sum_squares(center, _block_size);
+        }
+    });
+}
+
+cv::Mat ProductQuantizer::encode(const cv::Mat& descriptors) const {
+    
+    check_size(descriptors.cols, "encode");
+    if(descriptors.type() != CV_32F)
+        throw std::runtime_error("ProductQuantizer::encode(): the descriptors must be CV_32F!");
+    
+    // the closest centroid minimizes |c|^2 - 2<x,c>
+    cv::Mat codes(descriptors.rows, _n_blocks, CV_8U);
+    WorkStealingPool::default_pool()->parallel_for(descriptors.rows, [&](const size_t i, const size_t) {
+        const float* descriptor = descriptors.ptr<float>(i);
+        Code* code = codes.ptr<Code>(i);
+        for(size_t b = 0; b < _n_blocks; ++b) {
+            const float* block = descriptor + b*_block_size;
+            const float* centroids = &_centroids[b*_n_centroids*_block_size];
+            float best = std::numeric_limits<float>::max();
+            for(size_t c = 0; c < _n_centroids; ++c) {
+                const float distance = _centroid_norms[b*_n_centroids + c] - 
+                                       2*SimdKernels::dot(block, centroids + c*_block_size, _block_size);
+                if(distance < best) {
+                    best = distance;
+                    code[b] = static_cast<Code>(c);
+                }
+            }
+        }
+    });
+    return codes;
+}
+
+cv::Mat ProductQuantizer::decode(const cv::Mat& codes) const {
+    
+    check_size(codes.cols*_block_size, "decode");
+    if(codes.type() != CV_8U)
+        throw std::runtime_error("ProductQuantizer::decode(): the codes must be CV_8U!");
+    
+    cv::Mat descriptors(codes.rows, _n_blocks*_block_size, CV_32F);
+    for(int i = 0; i < codes.rows; ++i) {
+        const Code* code = codes.ptr<Code>(i);
+        float* descriptor = descriptors.ptr<float>(i);
+        for(size_t b = 0; b < _n_blocks; ++b) {
+            if(code[b] >= _n_centroids)
+                throw std::runtime_error("ProductQuantizer::decode(): the codes must be smaller than the number of centroids!");
+            const float* centroid = &_centroids[(b*_n_centroids + code[b])*_block_size];
+            std::copy(centroid, centroid + _block_size, descriptor + b*_block_size);
+        }
+    }
+    return descriptors;
+}
+
+cv::Mat ProductQuantizer::lookup_table(const cv::Mat& query) const {
+    
+    check_size(query.total(), "lookup_table");
+    if(query.type() != CV_32F || !query.isContinuous())
+        throw std::runtime_error("ProductQuantizer::lookup_table(): the query must be a continuous CV_32F matrix!");
+    
+    // |x-c|^2 = |x|^2 - 2<x,c> + |c|^2, codes without a centroid are infinitely far
+    cv::Mat table(_n_blocks, MAX_CENTROIDS, CV_32F, cv::Scalar(std::numeric_limits<float>::infinity()));
+    const float* values = query.ptr<float>(0);
+    for(size_t b = 0; b < _n_blocks; ++b) {
+        const float* block = values + b*_block_size;
+        const float norm = SimdKernels::sum_squares(block, _block_size);
+        float* row = table.ptr<float>(b);
+        for(size_t c = 0; c < _n_centroids; ++c)
+            row[c] = std::max(0.0f, norm - 2*SimdKernels::dot(block, &_centroids[(b*_n_centroids + c)*_block_size], _block_size) + 
+                                    _centroid_norms[b*_n_centroids + c]);
+    }
+    return table;
+}
+
+// sum of the lookups of the codes of rows [begin, end)
+static void code_distances(const cv::Mat& table, const cv::Mat& codes, const size_t begin, const size_t end, float* distances) {
+    const size_t n_blocks = table.rows;
+    const size_t n_centroids = table.cols;
+    const float* lookups = table.ptr<float>(0);
+    for(size_t i = begin; i < end; ++i) {
+        const ProductQuantizer::Code* code = codes.ptr<ProductQuantizer::Code>(i);
+        float distance = 0;
+        for(size_t b = 0; b < n_blocks; ++b)
+            distance += lookups[b*n_centroids + code[b]];
+        distances[i - begin] = distance;
+    }
+}
+
+std::vector<float> ProductQuantizer::distances(const cv::Mat& query, const cv::Mat& codes) const {
+    
+    check_size(codes.cols*_block_size, "distances");
+    if(codes.type() != CV_8U)
+        throw std::runtime_error("ProductQuantizer::distances(): the codes must be CV_8U!");
+    
+    const cv::Mat table = lookup_table(query);
+    std::vector<float> result(codes.rows);
+    const size_t n_chunks = (codes.rows + SEARCH_CHUNK - 1)/SEARCH_CHUNK;
+    WorkStealingPool::default_pool()->parallel_for(n_chunks, [&](const size_t chunk, const size_t) {
+        const size_t begin = chunk*SEARCH_CHUNK;
+        const size_t end = std::min(begin + SEARCH_CHUNK, static_cast<size_t>(codes.rows));
+        code_distances(table, codes, begin, end, &result[begin]);
+    });
+    return result;
+}
+
+std::vector<ProductQuantizer::Neighbour> ProductQuantizer::search(const cv::Mat& query, const cv::Mat& codes, const size_t k) const {
+    
+    check_size(codes.cols*_block_size, "search");
+    if(codes.type() != CV_8U)
+        throw std::runtime_error("ProductQuantizer::search(): the codes must be CV_8U!");
+    
+    auto closer = [](const Neighbour& a, const Neighbour& b) { 
+        return a.distance < b.distance || (a.distance == b.distance && a.index < b.index); 
+    };
+    
+    // each chunk keeps its k closest codes, then the chunks are merged
+    const cv::Mat table = lookup_table(query);
+    const size_t n_chunks = (codes.rows + SEARCH_CHUNK - 1)/SEARCH_CHUNK;
+    std::vector<std::vector<Neighbour>> chunk_neighbours(n_chunks);
+    WorkStealingPool::default_pool()->parallel_for(n_chunks, [&](const size_t chunk, const size_t) {
+        const size_t begin = chunk*SEARCH_CHUNK;
+        const size_t end = std::min(begin + SEARCH_CHUNK, static_cast<size_t>(codes.rows));
+        float distances[SEARCH_CHUNK];
+        code_distances(table, codes, begin, end, distances);
+        std::vector<Neighbour>& neighbours = chunk_neighbours[chunk];
+        for(size_t i = begin; i < end; ++i)
+            neighbours.push_back({i, distances[i - begin]});
+        if(neighbours.size() > k) {
+            std::nth_element(neighbours.begin(), neighbours.begin() + k, neighbours.end(), closer);
+            neighbours.resize(k);
+        }
+    });
+    
+    std::vector<Neighbour> neighbours;
+    for(const auto& chunk : chunk_neighbours)
+        neighbours.insert(neighbours.end(), chunk.begin(), chunk.end());
+    const size_t n = std::min(k, neighbours.size());
+    std::partial_sort(neighbours.begin(), neighbours.begin() + n, neighbours.end(), closer);
+    neighbours.resize(n);
+    return neighbours;
+}
+
+void ProductQuantizer::save(const std::string& filename) const {
+    
+    FileHeader header = {};
+    std::copy(FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC), header.magic);
+    header.endian_tag = FILE_ENDIAN_TAG;
+    header.version = FILE_VERSION;
+    header.n_blocks = _n_blocks;
+    header.block_size = _block_size;
+    header.n_centroids = _n_centroids;
+    
+    std::ofstream f(filename, std::ios::binary);
+    if(!f)
+        throw std::runtime_error("ProductQuantizer::save(): unable to open the file " + filename + "!");
+    f.write((const char*)&header, sizeof(header));
+    f.write((const char*)_centroids.data(), _centroids.size()*sizeof(float));
+    if(!f)
+        throw std::runtime_error("ProductQuantizer::save(): error while writing the file " + filename + "!");
+}
+
+ProductQuantizer ProductQuantizer::load(const std::string& filename) {
+    
+    std::ifstream f(filename, std::ios::binary);
+    if(!f)
+        throw std::runtime_error("ProductQuantizer::load(): unable to open the file " + filename + "!");
+    FileHeader header;
+    f.read((char*)&header, sizeof(header));
+    if(!f || !std::equal(FILE_MAGIC, FILE_MAGIC + sizeof(FILE_MAGIC), header.magic))
+        throw std::runtime_error("ProductQuantizer::load(): " + filename + " is not a quantizer file!");
+    if(header.endian_tag != FILE_ENDIAN_TAG)
+        throw std::runtime_error("ProductQuantizer::load(): " + filename + " was saved with another endianness!");
+    if(header.version > FILE_VERSION)
+        throw std::runtime_error("ProductQuantizer::load(): " + filename + " was saved by a newer version!");
+    if(header.n_centroids > MAX_CENTROIDS)
+        throw std::runtime_error("ProductQuantizer::load(): " + filename + " is corrupted!");
+    
+    ProductQuantizer quantizer;
+    quantizer._n_blocks = header.n_blocks;
+    quantizer._block_size = header.block_size;
+    quantizer._n_centroids = header.n_centroids;
+    quantizer._centroids.resize(header.n_blocks*header.n_centroids*header.block_size);
+    f.read((char*)quantizer._centroids.data(), quantizer._centroids.size()*sizeof(float));
+    if(!f)
+        throw std::runtime_error("ProductQuantizer::load(): " + filename + " is truncated!");
+    quantizer._centroid_norms.resize(quantizer._n_blocks*quantizer._n_centroids);
+    for(size_t c = 0; c < quantizer._centroid_norms.size(); ++c)
+        quantizer._centroid_norms[c] = SimdKernels::sum_squares(&quantizer._centroids[c*quantizer._block_size], quantizer._block_size);
+    return quantizer;
+}
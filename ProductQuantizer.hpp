@@ -0,0 +1,141 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: ProductQuantizer.hpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Product quantization of HOG descriptors block by block, with
+                    nearest neighbour search by asymmetric distance.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#ifndef PRODUCT_QUANTIZER_HPP
+#define PRODUCT_QUANTIZER_HPP
+
+#include "opencv2/core/core.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Compresses HOG descriptors (e.g. from HOG::retrieve_batch() or HOG::scan()) to one byte
+/// per block: each block position of the window has its own codebook of at most 256
+/// normalized blocks, learnt with k-means, and a block is stored as the index of its
+/// closest centroid. A query is compared to the codes without decoding them (asymmetric
+/// distance): the squared distances between each block of the query and the centroids of
+/// its position are computed once, then the distance of a code is a sum of lookups.
+class ProductQuantizer {
+public:
+    using Code = uint8_t;
+    static const size_t MAX_CENTROIDS = 256;
+
+    /// A result of ProductQuantizer::search()
+    struct Neighbour {
+        size_t index; ///< row of the code
+        float distance; ///< approximate squared L2 distance to the query
+    };
+
+    ProductQuantizer() = default;
+
+    /// Learns one codebook per block position with k-means
+    ///
+    /// @param descriptors: one row per window with its HOG, CV_32F
+    /// @param block_size: number of values of each block (see HOG::block_hist_size())
+    /// @param n_centroids: number of centroids of each codebook, at most 256 (and the number of rows)
+    /// @param n_iterations: maximum number of iterations of k-means
+    /// @return none
+    void train(const cv::Mat& descriptors, const size_t block_size, const size_t n_centroids = MAX_CENTROIDS,
+               const size_t n_iterations = 25);
+
+    /// Replaces each block of the descriptors by the index of its closest centroid
+    ///
+    /// @param descriptors: one row per window with its HOG, CV_32F
+    /// @return one row of codes per window, one column per block, CV_8U
+    cv::Mat encode(const cv::Mat& descriptors) const;
+
+    /// Replaces each code by its centroid
+    ///
+    /// @param codes: one row of codes per window, CV_8U, each smaller than the number of centroids
+    /// @return one row per window with its approximate HOG, CV_32F
+    cv::Mat decode(const cv::Mat& codes) const;
+
+    /// Squared distances between each block of a query and the centroids of its position
+    ///
+    /// @param query: HOG of a window
+    /// @return one row per block position, one column per code (MAX_CENTROIDS), CV_32F;
+    ///         the codes without a centroid are infinitely far
+    cv::Mat lookup_table(const cv::Mat& query) const;
+
+    /// Approximate squared L2 distance between a query and every code.
+    /// A code without a centroid in this quantizer is at an infinite distance.
+    ///
+    /// @param query: HOG of a window
+    /// @param codes: one row of codes per window, CV_8U
+    /// @return one distance per code
+    std::vector<float> distances(const cv::Mat& query, const cv::Mat& codes) const;
+
+    /// The codes closest to a query by asymmetric distance, on the threads of the default pool.
+    /// The codes without a centroid are the farthest, as in ProductQuantizer::distances().
+    ///
+    /// @param query: HOG of a window
+    /// @param codes: one row of codes per window, CV_8U
+    /// @param k: number of neighbours
+    /// @return the k closest codes, the closest first
+    std::vector<Neighbour> search(const cv::Mat& query, const cv::Mat& codes, const size_t k) const;
+
+    /// Number of block positions (bytes per code)
+    size_t n_blocks() const {
+        return _n_blocks;
+    }
+
+    /// Number of values of each block
+    size_t block_size() const {
+        return _block_size;
+    }
+
+    /// Number of centroids of each codebook
+    size_t n_centroids() const {
+        return _n_centroids;
+    }
+
+    /// Saves the codebooks in a binary file
+    ///
+    /// @param filename: name of the file
+    /// @return none
+    void save(const std::string& filename) const;
+
+    /// Loads the codebooks saved by ProductQuantizer::save()
+    ///
+    /// @param filename: name of the file
+    /// @return the quantizer
+    static ProductQuantizer load(const std::string& filename);
+
+private:
+    size_t _n_blocks = 0;
+    size_t _block_size = 0;
+    size_t _n_centroids = 0;
+    std::vector<float> _centroids; ///< [block][centroid][value]
+    std::vector<float> _centroid_norms; ///< squared norm of each centroid, [block][centroid]
+
+    /// Checks that the quantizer is trained and that the rows have its size
+    void check_size(const size_t size, const std::string& caller) const;
+};
+
+#endif
@@ -0,0 +1,278 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: SimdKernels.cpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Vectorized kernels of the block norms and of the cascade scores,
+                    built for several instruction sets and chosen at run time.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#include "SimdKernels.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HOG_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// a fused multiply-add rounds once, the other sets twice: keep them apart
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// number of partial sums of the reductions, the width of an AVX-512 register
+static const size_t LANES = 16;
+
+// the partial sums are added pairwise, always in the same order
+static float reduce(float* lanes) {
+    for (size_t width = LANES/2; width > 0; width /= 2)
+        for (size_t i = 0; i < width; ++i)
+            lanes[i] += lanes[i + width];
+    return lanes[0];
+}
+
+namespace generic {
+
+static float sum(const float* v, const size_t n) {
+    float lanes[LANES] = {0};
+    for (size_t i = 0; i < n; ++i)
+        lanes[i % LANES] += v[i];
+    return reduce(lanes);
+}
+
+static float sum_squares(const float* v, const size_t n) {
+    float lanes[LANES] = {0};
+    for (size_t i = 0; i < n; ++i)
+        lanes[i % LANES] += v[i]*v[i];
+    return reduce(lanes);
+}
+
+static float dot(const float* a, const float* b, const size_t n) {
+    float lanes[LANES] = {0};
+    for (size_t i = 0; i < n; ++i)
+        lanes[i % LANES] += a[i]*b[i];
+    return reduce(lanes);
+}
+
+static void divide(float* v, const size_t n, const float den) {
+    for (size_t i = 0; i < n; ++i)
+        v[i] /= den;
+}
+
+static void clamp(float* v, const size_t n, const float low, const float high) {
+    for (size_t i = 0; i < n; ++i)
+        v[i] = std::min(std::max(v[i], low), high);
+}
+
+static void sqrt(float* v, const size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        v[i] = std::sqrt(v[i]);
+}
+
+} // namespace generic
+
+#ifdef HOG_SIMD_X86
+
+// Each set processes the values by blocks of LANES with as many registers as needed
+// (4 with SSE, 2 with AVX2, 1 with AVX-512); the last n%LANES values go to their lane
+// once the registers are stored. The element-wise kernels are exact in every set.
+#define HOG_REDUCTION(NAME, ATTR, VEC, N_REGS, WIDTH, ZERO, ADD, STORE, TERM, TAIL)              \
+    ATTR static float NAME {                                                                 \
+        VEC acc[N_REGS];                                                                      \
+        for (size_t r = 0; r < N_REGS; ++r)                                                   \
+            acc[r] = ZERO;                                                                    \
+        size_t i = 0;                                                                         \
+        for (; i + LANES <= n; i += LANES)                                                    \
+            for (size_t r = 0; r < N_REGS; ++r)                                               \
+                acc[r] = ADD(acc[r], TERM);                                                   \
+        float lanes[LANES];                                                                   \
+        for (size_t r = 0; r < N_REGS; ++r)                                                   \
+            STORE(lanes + r*WIDTH, acc[r]);                                                   \
+        for (; i < n; ++i)                                                                    \
+            lanes[i % LANES] += TAIL;                                                         \
+        return reduce(lanes);                                                                 \
+    }
+
+#define HOG_KERNELS(NS, ATTR, VEC, WIDTH, ZERO, LOAD, STORE, SET1, ADD, MUL, DIV, MIN, MAX, SQRT)           \
+    namespace NS {                                                                                          \
+    HOG_REDUCTION(sum(const float* v, const size_t n), ATTR, VEC, LANES/WIDTH, WIDTH, ZERO, ADD, STORE,       \
+                  LOAD(v + i + r*WIDTH), v[i])                                                              \
+    HOG_REDUCTION(sum_squares(const float* v, const size_t n), ATTR, VEC, LANES/WIDTH, WIDTH, ZERO, ADD,       \
+                  STORE, MUL(LOAD(v + i + r*WIDTH), LOAD(v + i + r*WIDTH)), v[i]*v[i])                      \
+    HOG_REDUCTION(dot(const float* a, const float* b, const size_t n), ATTR, VEC, LANES/WIDTH, WIDTH, ZERO,   \
+                  ADD, STORE, MUL(LOAD(a + i + r*WIDTH), LOAD(b + i + r*WIDTH)), a[i]*b[i])                 \
+    ATTR static void divide(float* v, const size_t n, const float den) {                                    \
+        const VEC d = SET1(den);                                                                            \
+        size_t i = 0;                                                                                       \
+        for (; i + WIDTH <= n; i += WIDTH)                                                                  \
+            STORE(v + i, DIV(LOAD(v + i), d));                                                              \
+        for (; i < n; ++i)                                                                                  \
+            v[i] /= den;                                                                                    \
+    }                                                                                                       \
+    ATTR static void clamp(float* v, const size_t n, const float low, const float high) {                   \
+        const VEC l = SET1(low), h = SET1(high);                                                            \
+        size_t i = 0;                                                                                       \
+        for (; i + WIDTH <= n; i += WIDTH)                                                                  \
+            STORE(v + i, MIN(MAX(LOAD(v + i), l), h));                                                      \
+        for (; i < n; ++i)                                                                                  \
+            v[i] = std::min(std::max(v[i], low), high);                                                     \
+    }                                                                                                       \
+    ATTR static void sqrt(float* v, const size_t n) {                                                       \
+        size_t i = 0;                                                                                       \
+        for (; i + WIDTH <= n; i += WIDTH)                                                                  \
+            STORE(v + i, SQRT(LOAD(v + i)));                                                                \
+        for (; i < n; ++i)                                                                                  \
+            v[i] = std::sqrt(v[i]);                                                                         \
+    }                                                                                                       \
+    }
+
+HOG_KERNELS(sse4, __attribute__((target("sse4.1"))), __m128, 4, _mm_setzero_ps(), _mm_loadu_ps, _mm_storeu_ps,
+            _mm_set1_ps, _mm_add_ps, _mm_mul_ps, _mm_div_ps, _mm_min_ps, _mm_max_ps, _mm_sqrt_ps)
+HOG_KERNELS(avx2, __attribute__((target("avx2"))), __m256, 8, _mm256_setzero_ps(), _mm256_loadu_ps, _mm256_storeu_ps,
+            _mm256_set1_ps, _mm256_add_ps, _mm256_mul_ps, _mm256_div_ps, _mm256_min_ps, _mm256_max_ps, _mm256_sqrt_ps)
+// GCC reports the undefined pass-through operand of the AVX-512 intrinsics as uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+HOG_KERNELS(avx512, __attribute__((target("avx512f"))), __m512, 16, _mm512_setzero_ps(), _mm512_loadu_ps, _mm512_storeu_ps,
+            _mm512_set1_ps, _mm512_add_ps, _mm512_mul_ps, _mm512_div_ps, _mm512_min_ps, _mm512_max_ps, _mm512_sqrt_ps)
+#pragma GCC diagnostic pop
+
+#endif
+
+// the kernels of one instruction set
+struct KernelTable {
+    SimdKernels::ISA isa;
+    float (*sum)(const float*, const size_t);
+    float (*sum_squares)(const float*, const size_t);
+    float (*dot)(const float*, const float*, const size_t);
+    void (*divide)(float*, const size_t, const float);
+    void (*clamp)(float*, const size_t, const float, const float);
+    void (*sqrt)(float*, const size_t);
+};
+
+#define HOG_KERNEL_TABLE(NS, ISA) \
+    {ISA, NS::sum, NS::sum_squares, NS::dot, NS::divide, NS::clamp, NS::sqrt}
+
+static const KernelTable TABLES[] = {
+    HOG_KERNEL_TABLE(generic, SimdKernels::ISA::generic),
+#ifdef HOG_SIMD_X86
+    HOG_KERNEL_TABLE(sse4, SimdKernels::ISA::sse4),
+    HOG_KERNEL_TABLE(avx2, SimdKernels::ISA::avx2),
+    HOG_KERNEL_TABLE(avx512, SimdKernels::ISA::avx512),
+#endif
+};
+
+static bool cpu_supports(const SimdKernels::ISA isa) {
+#ifdef HOG_SIMD_X86
+    __builtin_cpu_init();
+    switch (isa) {
+    case SimdKernels::ISA::generic: return true;
+    case SimdKernels::ISA::sse4: return __builtin_cpu_supports("sse4.1");
+    case SimdKernels::ISA::avx2: return __builtin_cpu_supports("avx2");
+    case SimdKernels::ISA::avx512: return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+#else
+    return isa == SimdKernels::ISA::generic;
+#endif
+}
+
+static const KernelTable* table_of(const SimdKernels::ISA isa) {
+    for (const auto& table : TABLES)
+        if (table.isa == isa)
+            return &table;
+    return nullptr;
+}
+
+// the best supported set, or the one of HOG_ISA
+static const KernelTable* startup_table() {
+    const std::vector<SimdKernels::ISA> isas = SimdKernels::supported_isas();
+    const char* forced = std::getenv("HOG_ISA");
+    if (forced)
+        for (auto isa : isas)
+            if (SimdKernels::name(isa) == forced)
+                return table_of(isa);
+    return table_of(isas.back());
+}
+
+static std::atomic<const KernelTable*>& current_table() {
+    static std::atomic<const KernelTable*> table(startup_table());
+    return table;
+}
+
+std::vector<SimdKernels::ISA> SimdKernels::supported_isas() {
+    std::vector<ISA> isas;
+    for (const auto& table : TABLES)
+        if (cpu_supports(table.isa))
+            isas.push_back(table.isa);
+    return isas;
+}
+
+SimdKernels::ISA SimdKernels::isa() {
+    return current_table().load()->isa;
+}
+
+void SimdKernels::set_isa(const ISA isa) {
+    const KernelTable* table = table_of(isa);
+    if (!table || !cpu_supports(isa))
+        throw std::runtime_error("SimdKernels::set_isa(): " + name(isa) + " is not supported by this CPU!");
+    current_table() = table;
+}
+
+std::string SimdKernels::name(const ISA isa) {
+    switch (isa) {
+    case ISA::generic: return "generic";
+    case ISA::sse4: return "sse4";
+    case ISA::avx2: return "avx2";
+    case ISA::avx512: return "avx512";
+    }
+    return "unknown";
+}
+
+float SimdKernels::sum(const float* v, const size_t n) {
+    return current_table().load()->sum(v, n);
+}
+
+float SimdKernels::sum_squares(const float* v, const size_t n) {
+    return current_table().load()->sum_squares(v, n);
+}
+
+float SimdKernels::dot(const float* a, const float* b, const size_t n) {
+    return current_table().load()->dot(a, b, n);
+}
+
+void SimdKernels::divide(float* v, const size_t n, const float den) {
+    current_table().load()->divide(v, n, den);
+}
+
+void SimdKernels::clamp(float* v, const size_t n, const float low, const float high) {
+    current_table().load()->clamp(v, n, low, high);
+}
+
+void SimdKernels::sqrt(float* v, const size_t n) {
+    current_table().load()->sqrt(v, n);
+}
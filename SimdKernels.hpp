@@ -0,0 +1,84 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: SimdKernels.hpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Vectorized kernels of the block norms and of the cascade scores,
+                    built for several instruction sets and chosen at run time.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#ifndef SIMD_KERNELS_HPP
+#define SIMD_KERNELS_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/// Kernels of the block norms (HOG::L1norm(), HOG::L2norm(), ...) and of the cascade
+/// scores, compiled for several x86 instruction sets in the same binary. The best set
+/// supported by the CPU is selected the first time a kernel is called, unless the
+/// environment variable HOG_ISA is set to one of "generic", "sse4", "avx2" or "avx512"
+/// (a set not supported by the CPU is ignored). SimdKernels::set_isa() changes it later.
+///
+/// All the sets give bitwise identical results: the sums are accumulated in 16 lanes
+/// (value i goes to lane i%16) that are added in the same order at the end, and the
+/// multiplications and additions are never fused.
+class SimdKernels {
+public:
+    enum class ISA {generic, sse4, avx2, avx512};
+
+    /// Instruction sets supported by this CPU, from the most basic
+    static std::vector<ISA> supported_isas();
+
+    /// Instruction set of the kernels currently in use
+    static ISA isa();
+
+    /// Selects the kernels of an instruction set
+    ///
+    /// @param isa: the instruction set, it must be supported by the CPU
+    /// @return none
+    static void set_isa(const ISA isa);
+
+    /// Name of an instruction set, as in the HOG_ISA environment variable
+    static std::string name(const ISA isa);
+
+    /// Sum of n values
+    static float sum(const float* v, const size_t n);
+
+    /// Sum of the squares of n values
+    static float sum_squares(const float* v, const size_t n);
+
+    /// Dot product of two vectors of n values
+    static float dot(const float* a, const float* b, const size_t n);
+
+    /// Divides n values by den
+    static void divide(float* v, const size_t n, const float den);
+
+    /// Clamps n values to [low, high]
+    static void clamp(float* v, const size_t n, const float low, const float high);
+
+    /// Square root of n values
+    static void sqrt(float* v, const size_t n);
+};
+
+#endif
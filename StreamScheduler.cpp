@@ -0,0 +1,222 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: StreamScheduler.cpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Shared scheduler of the frames of several streams (cameras) with
+                    per-stream deadlines and priorities, on one pool of threads.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#include "StreamScheduler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// number of latencies kept per stream for the percentiles
+static const size_t LATENCY_WINDOW = 1024;
+// weight of the last frame in the running estimates of the processing time
+static const double COST_SMOOTHING = 0.2;
+
+static double elapsed_ms(const StreamScheduler::Clock::time_point from, const StreamScheduler::Clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+StreamScheduler::StreamScheduler(const std::shared_ptr<WorkStealingPool>& pool, const size_t max_in_flight)
+    : _pool(pool ? pool : WorkStealingPool::default_pool()),
+      _max_in_flight(max_in_flight > 0 ? max_in_flight : _pool->size()) {
+}
+
+StreamScheduler::~StreamScheduler() {
+    // the tasks on the pool refer to this object
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this] { return _n_in_flight == 0 && _n_queued == 0; });
+}
+
+size_t StreamScheduler::add_stream(const HOG& hog, const StreamConfig& config) {
+    if(config.stride == 0)
+        throw std::runtime_error("StreamScheduler::add_stream(): the stride must be positive!");
+    if(config.window.width <= 0 || config.window.height <= 0)
+        throw std::runtime_error("StreamScheduler::add_stream(): the window is empty!");
+    if(config.deadline_ms <= 0)
+        throw std::runtime_error("StreamScheduler::add_stream(): the deadline must be positive!");
+    
+    std::unique_ptr<Stream> stream(new Stream(hog, config));
+    stream->hog.set_pool(_pool);
+    stream->latencies.reserve(LATENCY_WINDOW);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _streams.push_back(std::move(stream));
+    return _streams.size() - 1;
+}
+
+void StreamScheduler::submit(const size_t stream, const cv::Mat& frame) {
+    const Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(stream >= _streams.size())
+        throw std::runtime_error("StreamScheduler::submit(): unknown stream!");
+    Stream& s = *_streams[stream];
+    const auto deadline = std::chrono::duration_cast<Clock::duration>(
+                              std::chrono::duration<double, std::milli>(s.config.deadline_ms));
+    ++s.stats.submitted;
+    if(s.config.max_queued > 0 && s.queue.size() >= s.config.max_queued) {
+        s.queue.pop_front();
+        ++s.stats.dropped;
+        --_n_queued;
+    }
+    s.queue.push_back(Frame{frame, s.n_frames++, now, now + deadline});
+    ++_n_queued;
+    dispatch();
+}
+
+void StreamScheduler::flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this] { return _n_in_flight == 0 && _n_queued == 0; });
+    if(_error) {
+        std::exception_ptr error = _error;
+        _error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+StreamScheduler::StreamStats StreamScheduler::stats(const size_t stream) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(stream >= _streams.size())
+        throw std::runtime_error("StreamScheduler::stats(): unknown stream!");
+    const Stream& s = *_streams[stream];
+    StreamStats stats = s.stats;
+    std::vector<double> latencies = s.latencies;
+    if(!latencies.empty()) {
+        // nearest-rank percentiles
+        auto percentile = [&latencies](const double q) {
+            const size_t rank = static_cast<size_t>(std::ceil(q*latencies.size()));
+            auto nth = std::begin(latencies) + std::max<size_t>(rank, 1) - 1;
+            std::nth_element(std::begin(latencies), nth, std::end(latencies));
+            return *nth;
+        };
+        stats.p50_ms = percentile(0.5);
+        stats.p99_ms = percentile(0.99);
+    }
+    return stats;
+}
+
+void StreamScheduler::dispatch() {
+    while(_n_in_flight < _max_in_flight) {
+        // the most urgent frame: highest priority first, then earliest deadline
+        Stream* best = nullptr;
+        size_t best_index = 0;
+        for (size_t i = 0; i < _streams.size(); ++i) {
+            const Stream& s = *_streams[i];
+            if(s.busy || s.queue.empty())
+                continue;
+            if(!best || s.config.priority > best->config.priority ||
+               (s.config.priority == best->config.priority && s.queue.front().deadline < best->queue.front().deadline)) {
+                best = _streams[i].get();
+                best_index = i;
+            }
+        }
+        if(!best)
+            break;
+        
+        Frame frame = std::move(best->queue.front());
+        best->queue.pop_front();
+        --_n_queued;
+        const size_t stride = choose_stride(*best, frame, Clock::now());
+        if(stride == 0) {
+            // the estimates decay while the frames are dropped, otherwise a stream
+            // slowed down once by the others would never be tried again
+            best->ms_per_pixel *= 1 - COST_SMOOTHING;
+            best->ms_per_window *= 1 - COST_SMOOTHING;
+            ++best->stats.dropped;
+            continue;
+        }
+        best->busy = true;
+        ++_n_in_flight;
+        _pool->submit([this, best, best_index, frame, stride]() { run(*best, best_index, frame, stride); });
+    }
+    if(_n_in_flight == 0 && _n_queued == 0)
+        _idle.notify_all();
+}
+
+size_t StreamScheduler::choose_stride(const Stream& stream, const Frame& frame, const Clock::time_point now) const {
+    const double time_left = elapsed_ms(now, frame.deadline);
+    if(time_left <= 0)
+        return 0;
+    const StreamConfig& config = stream.config;
+    const double process_ms = stream.ms_per_pixel*frame.image.total();
+    const size_t max_stride = std::max(config.stride, config.max_stride);
+    for (size_t stride = config.stride; stride <= max_stride; stride *= 2) {
+        size_t n_windows = 0;
+        if(frame.image.cols >= config.window.width && frame.image.rows >= config.window.height)
+            n_windows = ((frame.image.cols - config.window.width)/stride + 1)*
+                        ((frame.image.rows - config.window.height)/stride + 1);
+        if(process_ms + stream.ms_per_window*n_windows <= time_left)
+            return stride;
+    }
+    return 0;
+}
+
+void StreamScheduler::run(Stream& stream, const size_t index, const Frame& frame, const size_t stride) {
+    // only this task uses the HOG object of the stream until busy is cleared
+    try {
+        FrameResult result;
+        result.stream = index;
+        result.frame = frame.index;
+        result.stride = stride;
+        const Clock::time_point start = Clock::now();
+        stream.hog.process(frame.image);
+        const Clock::time_point processed = Clock::now();
+        result.descriptors = stream.hog.scan(stream.config.window, stride, result.windows);
+        const Clock::time_point scanned = Clock::now();
+        result.latency_ms = elapsed_ms(frame.submitted, scanned);
+        result.deadline_met = scanned <= frame.deadline;
+        if(stream.config.consume)
+            stream.config.consume(result);
+        
+        std::lock_guard<std::mutex> lock(_mutex);
+        StreamStats& stats = stream.stats;
+        ++stats.processed;
+        if(stride != stream.config.stride)
+            ++stats.degraded;
+        if(!result.deadline_met)
+            ++stats.late;
+        if(stream.latencies.size() < LATENCY_WINDOW)
+            stream.latencies.push_back(result.latency_ms);
+        else
+            stream.latencies[stream.next_latency] = result.latency_ms;
+        stream.next_latency = (stream.next_latency + 1) % LATENCY_WINDOW;
+        
+        // running estimates of the time per pixel and per window, the first frame sets them
+        const double ms_per_pixel = elapsed_ms(start, processed)/std::max<size_t>(frame.image.total(), 1);
+        const double ms_per_window = elapsed_ms(processed, scanned)/std::max<size_t>(result.windows.size(), 1);
+        const double weight = stats.processed == 1 ? 1 : COST_SMOOTHING;
+        stream.ms_per_pixel += weight*(ms_per_pixel - stream.ms_per_pixel);
+        stream.ms_per_window += weight*(ms_per_window - stream.ms_per_window);
+    } catch(...) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_error)
+            _error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    stream.busy = false;
+    --_n_in_flight;
+    dispatch();
+}
@@ -0,0 +1,163 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: StreamScheduler.hpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Shared scheduler of the frames of several streams (cameras) with
+                    per-stream deadlines and priorities, on one pool of threads.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#ifndef STREAM_SCHEDULER_HPP
+#define STREAM_SCHEDULER_HPP
+
+#include "HOG.hpp"
+#include "WorkStealingPool.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class StreamScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Descriptors of the windows of a processed frame
+    struct FrameResult {
+        size_t stream;                ///< index of the stream
+        size_t frame;                 ///< index of the frame in its stream, in order of submission
+        size_t stride;                ///< stride of the scan, bigger than the one of the stream when degraded
+        std::vector<cv::Rect> windows;
+        cv::Mat descriptors;          ///< one row per window
+        double latency_ms;            ///< from the submission to the end of the scan
+        bool deadline_met;
+    };
+    using FrameConsumer = std::function<void(const FrameResult& result)>;
+
+    /// Parameters of a stream
+    struct StreamConfig {
+        cv::Size window;              ///< size of the windows scanned
+        size_t stride;                ///< stride of the scan when the deadline allows it
+        size_t max_stride;            ///< coarsest stride used before dropping a frame (0 = stride)
+        int priority;                 ///< frames of higher priority are processed first
+        double deadline_ms;           ///< maximum latency of a frame from its submission
+        size_t max_queued;            ///< frames waiting at most, the oldest one is dropped beyond (0 = no limit)
+        FrameConsumer consume;        ///< called on a thread of the pool for each frame processed
+    };
+
+    /// Counters and latency of a stream
+    struct StreamStats {
+        size_t submitted = 0;
+        size_t processed = 0;
+        size_t dropped = 0;           ///< replaced in a full queue, or that couldn't meet the deadline
+        size_t degraded = 0;          ///< processed with a coarser stride
+        size_t late = 0;              ///< processed but after the deadline
+        double p50_ms = 0;            ///< median latency of the last frames processed
+        double p99_ms = 0;            ///< 99th percentile of the latency of the last frames processed
+    };
+
+    /// @param pool: pool shared by all the streams, nullptr for the default one
+    /// @param max_in_flight: maximum number of frames processed at the same time (0 = one per thread of the pool)
+    explicit StreamScheduler(const std::shared_ptr<WorkStealingPool>& pool = nullptr, const size_t max_in_flight = 0);
+
+    /// Waits for the frames queued and in progress
+    ~StreamScheduler();
+
+    StreamScheduler(const StreamScheduler&) = delete;
+    StreamScheduler& operator=(const StreamScheduler&) = delete;
+
+    /// Adds a stream. The frames of a stream are processed one at a time, in order,
+    /// by a copy of hog running on the pool of the scheduler.
+    ///
+    /// @param hog: the HOG parameters of the stream
+    /// @param config: the window, stride, priority and deadline of the stream
+    /// @return index of the stream
+    size_t add_stream(const HOG& hog, const StreamConfig& config);
+
+    /// Queues a frame. The pixels are shared, not copied, so the frame must not be
+    /// written until it is processed (e.g. use a new cv::Mat per frame).
+    ///
+    /// @param stream: index of the stream
+    /// @param frame: the image
+    /// @return none
+    void submit(const size_t stream, const cv::Mat& frame);
+
+    /// Waits until all the frames submitted are processed or dropped.
+    /// Rethrows the first exception thrown while processing a frame.
+    ///
+    /// @return none
+    void flush();
+
+    /// Counters and latency percentiles of a stream
+    ///
+    /// @param stream: index of the stream
+    /// @return the statistics of the stream
+    StreamStats stats(const size_t stream) const;
+
+private:
+    struct Frame {
+        cv::Mat image;
+        size_t index;
+        Clock::time_point submitted;
+        Clock::time_point deadline;
+    };
+
+    struct Stream {
+        HOG hog;
+        StreamConfig config;
+        std::deque<Frame> queue;
+        bool busy = false;            ///< a frame of the stream is in progress
+        size_t n_frames = 0;          ///< frames submitted so far, index of the next one
+        StreamStats stats;
+        std::vector<double> latencies; ///< latency of the last frames processed, circular
+        size_t next_latency = 0;
+        double ms_per_pixel = 0;      ///< running estimate of the time of HOG::process()
+        double ms_per_window = 0;     ///< running estimate of the time of HOG::scan()
+
+        Stream(const HOG& hog, const StreamConfig& config) : hog(hog), config(config) {}
+    };
+
+    std::shared_ptr<WorkStealingPool> _pool;
+    size_t _max_in_flight;
+    std::vector<std::unique_ptr<Stream>> _streams;
+    mutable std::mutex _mutex;        ///< guards the streams and the counters below
+    std::condition_variable _idle;
+    size_t _n_in_flight = 0;
+    size_t _n_queued = 0;
+    std::exception_ptr _error;
+
+    /// Starts the most urgent frames while there are free slots, drops the ones
+    /// that can't meet their deadline. Called with _mutex locked.
+    void dispatch();
+
+    /// Processes and scans a frame on the pool, then updates the stream
+    void run(Stream& stream, const size_t index, const Frame& frame, const size_t stride);
+
+    /// Finest stride of a stream whose estimated time fits in the time left, 0 if none
+    size_t choose_stride(const Stream& stream, const Frame& frame, const Clock::time_point now) const;
+};
+
+#endif
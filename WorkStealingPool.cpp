@@ -0,0 +1,223 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: WorkStealingPool.cpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Fixed pool of worker threads with per-worker task queues and
+                    work stealing, used by HOG to spread crops, bands and windows.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#include "WorkStealingPool.hpp"
+#include <algorithm>
+#include <exception>
+
+// the pool and the index of the worker running on this thread, if any
+static thread_local const WorkStealingPool* current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+// set when the pool is destroyed by one of its own workers, e.g. when a task held the last reference to it
+static thread_local bool current_pool_destroyed = false;
+
+WorkStealingPool::WorkStealingPool(const size_t n_threads) {
+    const size_t n = n_threads > 0 ? n_threads : std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < n; ++i)
+        _queues.emplace_back(new Queue());
+    for (size_t i = 0; i < n; ++i)
+        _threads.emplace_back(&WorkStealingPool::run, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& thread : _threads) {
+        if (thread.get_id() == std::this_thread::get_id()) {
+            // a worker can't join itself, it leaves run() as soon as the task returns
+            current_pool_destroyed = true;
+            thread.detach();
+        } else {
+            thread.join();
+        }
+    }
+}
+
+void WorkStealingPool::submit(Task task) {
+    const size_t queue = current_pool == this ? current_worker : _next_queue++ % _queues.size();
+    {
+        std::lock_guard<std::mutex> lock(_queues[queue]->mutex);
+        _queues[queue]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_n_tasks;
+    }
+    _wake.notify_one();
+}
+
+bool WorkStealingPool::pop(const size_t worker, Task& task) {
+    for (size_t i = 0; i < _queues.size(); ++i) {
+        const size_t victim = (worker + i) % _queues.size();
+        std::lock_guard<std::mutex> lock(_queues[victim]->mutex);
+        auto& tasks = _queues[victim]->tasks;
+        if (tasks.empty())
+            continue;
+        if (victim == worker) {
+            task = std::move(tasks.back());
+            tasks.pop_back();
+        } else {
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::run(const size_t worker) {
+    current_pool = this;
+    current_worker = worker;
+    while (!current_pool_destroyed) {
+        {
+            Task task;
+            if (pop(worker, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    --_n_tasks;
+                }
+                task();
+                continue;
+            }
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wake.wait(lock, [this]() { return _stop || _n_tasks > 0; });
+        if (_stop && _n_tasks <= 0)
+            return;
+    }
+}
+
+void WorkStealingPool::parallel_for(const size_t n, const std::function<void(const size_t, const size_t)>& body) {
+    if (n == 0)
+        return;
+
+    // the state shared by the participants, it outlives the call for the
+    // participants that start once all the indices are done
+    struct Job {
+        struct Range {
+            std::mutex mutex;
+            size_t begin = 0;
+            size_t end = 0;
+        };
+        std::vector<Range> ranges;
+        const std::function<void(const size_t, const size_t)>* body;
+        size_t n;
+        std::atomic<size_t> next_slot{1};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr error;
+
+        Job(const size_t n_slots, const size_t n_indices) : ranges(n_slots), n(n_indices) {}
+
+        bool take(const size_t slot, size_t& index) {
+            std::lock_guard<std::mutex> lock(ranges[slot].mutex);
+            if (ranges[slot].begin == ranges[slot].end)
+                return false;
+            index = ranges[slot].begin++;
+            return true;
+        }
+
+        bool steal(const size_t slot, size_t& index) {
+            // the victim with the most indices left loses the upper half of its range
+            size_t victim = slot;
+            size_t largest = 0;
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                std::lock_guard<std::mutex> lock(ranges[i].mutex);
+                if (i != slot && ranges[i].end - ranges[i].begin > largest) {
+                    largest = ranges[i].end - ranges[i].begin;
+                    victim = i;
+                }
+            }
+            if (victim == slot)
+                return false;
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lock(ranges[victim].mutex);
+                if (ranges[victim].begin == ranges[victim].end)
+                    return steal(slot, index);
+                begin = ranges[victim].begin + (ranges[victim].end - ranges[victim].begin)/2;
+                end = ranges[victim].end;
+                ranges[victim].end = begin;
+            }
+            std::lock_guard<std::mutex> lock(ranges[slot].mutex);
+            index = begin;
+            ranges[slot].begin = begin + 1;
+            ranges[slot].end = end;
+            return true;
+        }
+
+        void participate(const size_t slot) {
+            size_t index;
+            while (take(slot, index) || steal(slot, index)) {
+                try {
+                    (*body)(index, slot);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                        error = std::current_exception();
+                }
+                if (++done == n) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished.notify_all();
+                }
+            }
+        }
+    };
+
+    const size_t n_slots = std::min(n, max_slots());
+    auto job = std::make_shared<Job>(n_slots, n);
+    job->body = &body;
+    for (size_t slot = 0; slot < n_slots; ++slot) {
+        job->ranges[slot].begin = n*slot/n_slots;
+        job->ranges[slot].end = n*(slot + 1)/n_slots;
+    }
+
+    for (size_t i = 1; i < n_slots; ++i) {
+        submit([job]() {
+            const size_t slot = job->next_slot++;
+            if (slot < job->ranges.size())
+                job->participate(slot);
+        });
+    }
+    job->participate(0);
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&job]() { return job->done == job->n; });
+    if (job->error)
+        std::rethrow_exception(job->error);
+}
+
+std::shared_ptr<WorkStealingPool> WorkStealingPool::default_pool() {
+    static std::shared_ptr<WorkStealingPool> pool = std::make_shared<WorkStealingPool>();
+    return pool;
+}
@@ -0,0 +1,115 @@
+/*  ==========================================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: WorkStealingPool.hpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Fixed pool of worker threads with per-worker task queues and
+                    work stealing, used by HOG to spread crops, bands and windows.
+
+    ==========================================================================================
+    Copyright (c) 2016 Leonardo Citraro <ldo.citraro@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this
+    software and associated documentation files (the "Software"), to deal in the Software
+    without restriction, including without limitation the rights to use, copy, modify,
+    merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+    permit persons to whom the Software is furnished to do so, subject to the following
+    conditions:
+
+    The above copyright notice and this permission notice shall be included in all copies
+    or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+    PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE
+    FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+    OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+    ==========================================================================================
+*/
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    /// Starts the worker threads
+    ///
+    /// @param n_threads: number of worker threads (0 = std::thread::hardware_concurrency())
+    explicit WorkStealingPool(const size_t n_threads = 0);
+
+    /// Runs the tasks still queued, then stops the worker threads.
+    /// The pool can also be destroyed by one of its tasks (e.g. when the task
+    /// holds the last reference to it): that worker is detached instead of joined.
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    /// Number of worker threads
+    size_t size() const {
+        return _threads.size();
+    }
+
+    /// Number of distinct slots passed by parallel_for() to its body (the workers and the caller)
+    size_t max_slots() const {
+        return _threads.size() + 1;
+    }
+
+    /// Queues a task. From a worker thread the task goes to the worker's own queue,
+    /// otherwise the queues are filled in turn. Idle workers steal from the others.
+    ///
+    /// @param task: the task to run
+    /// @return none
+    void submit(Task task);
+
+    /// Runs body(index, slot) for every index in [0, n) and returns when all are done.
+    /// The indices are split in one range per participant (the workers and the calling
+    /// thread); a participant with an empty range steals half of the largest one left.
+    /// The slot, in [0, max_slots()), is unique among the threads running the same
+    /// call so it can select per-thread scratch buffers. The calling thread takes part,
+    /// so parallel_for() can be called from a task of the pool itself.
+    /// The first exception thrown by body is rethrown once all the indices are done.
+    ///
+    /// @param n: number of indices
+    /// @param body: function called for each index
+    /// @return none
+    void parallel_for(const size_t n, const std::function<void(const size_t index, const size_t slot)>& body);
+
+    /// Process-wide pool with one worker per hardware thread
+    ///
+    /// @return the default pool
+    static std::shared_ptr<WorkStealingPool> default_pool();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> _queues; ///< one queue per worker
+    std::vector<std::thread> _threads;
+    std::mutex _mutex; ///< guards _n_tasks and _stop
+    std::condition_variable _wake;
+    long long _n_tasks = 0; ///< number of queued tasks
+    bool _stop = false;
+    std::atomic<size_t> _next_queue{0}; ///< queue for the next task submitted from outside of the pool
+
+    /// Loop of a worker thread
+    void run(const size_t worker);
+
+    /// Pops a task from the worker's own queue (newest first) or steals one from another queue (oldest first)
+    bool pop(const size_t worker, Task& task);
+};
+
+#endif
@@ -0,0 +1,3 @@
+#!/bin/bash
+rm -rdf ./build > /dev/null 2>&1
+rm -rdf ./*~ > /dev/null 2>&1
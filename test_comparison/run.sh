@@ -0,0 +1,7 @@
+#!/bin/bash
+# the first run saves the baseline, the next ones fail (exit code 1) on a regression against it
+if [ -f baseline.txt ]; then
+    ./build/test_comparison --baseline baseline.txt
+else
+    ./build/test_comparison --save baseline.txt
+fi
@@ -0,0 +1,333 @@
+/*  =========================================================================
+    Author: Leonardo Citraro
+    Company:
+    Filename: test_comparison.cpp
+    Last modifed:   19.10.2026 by Leonardo Citraro
+    Description:    Speed and accuracy of HOG against cv::HOGDescriptor
+
+    =========================================================================
+    https://lear.inrialpes.fr/people/triggs/pubs/Dalal-cvpr05.pdf
+    =========================================================================
+*/
+#include "HOG.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/objdetect/objdetect.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <map>
+#include <string>
+#include <thread>
+#include <cmath>
+#include <cstring>
+#include <sys/resource.h>
+
+// Usage: test_comparison [--baseline file] [--save file] [--repetitions n]
+//
+// Both implementations compute the descriptors of all the windows of a dense scan
+// (window of 8x16 cells, one cell apart) of the same images, for a sweep of parameters,
+// image sizes and thread counts. For each run: the throughput in windows per second,
+// the 50th and 99th percentiles of the latency of one image and the peak resident
+// memory. The descriptors are compared with the Pearson correlation of each window,
+// and the people detector of OpenCV is run on both to count the detections they agree on.
+//
+// The ratio of the speeds (OpenCV's latency over ours) and the correlations can be saved
+// as a baseline; against a baseline, the program returns 1 if a ratio dropped by more
+// than SPEEDUP_TOLERANCE or a correlation by more than CORRELATION_TOLERANCE.
+
+static const double SPEEDUP_TOLERANCE = 0.15;
+static const double CORRELATION_TOLERANCE = 0.02;
+
+struct Config {
+    size_t cellsize;
+    size_t blocksize;
+    size_t stride;
+    size_t binning;
+};
+
+struct Latency {
+    double p50; ///< [ms]
+    double p99; ///< [ms]
+    double mean; ///< [ms]
+};
+
+// The peak resident memory is reset before each run (Linux >= 4.0), otherwise it
+// is the peak of the whole process so far
+static void reset_peak_rss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
+
+static long peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status, line))
+        if(line.compare(0, 6, "VmHWM:") == 0)
+            return std::stol(line.substr(6));
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// runs a function once to warm up, then n times
+template<typename F>
+static Latency measure_latency(F&& func, const size_t n) {
+    func();
+    std::vector<double> samples;
+    for(size_t i=0; i<n; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        samples.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(std::begin(samples), std::end(samples));
+    auto percentile = [&samples](const double p) {
+        return samples[std::min(samples.size() - 1, static_cast<size_t>(std::ceil(p*samples.size())) - 1)];
+    };
+    return {percentile(0.5), percentile(0.99), std::accumulate(std::begin(samples), std::end(samples), 0.0)/samples.size()};
+}
+
+// Index in the descriptor of cv::HOGDescriptor of each value of the descriptor of
+// HOG::retrieve(). OpenCV orders the blocks and the cells of a block column by column,
+// HOG row by row.
+static std::vector<size_t> opencv_layout(const Config& config, const cv::Size& window) {
+    const size_t n_cells = config.blocksize/config.cellsize;
+    const size_t n_blocks_x = (window.width - config.blocksize)/config.stride + 1;
+    const size_t n_blocks_y = (window.height - config.blocksize)/config.stride + 1;
+    std::vector<size_t> layout;
+    for(size_t by=0; by<n_blocks_y; ++by)
+        for(size_t bx=0; bx<n_blocks_x; ++bx)
+            for(size_t cy=0; cy<n_cells; ++cy)
+                for(size_t cx=0; cx<n_cells; ++cx)
+                    for(size_t bin=0; bin<config.binning; ++bin)
+                        layout.push_back(((bx*n_blocks_y + by)*n_cells*n_cells + cx*n_cells + cy)*config.binning + bin);
+    return layout;
+}
+
+static double correlation(const float* a, const float* b, const std::vector<size_t>& layout) {
+    const size_t n = layout.size();
+    double mean_a = 0, mean_b = 0;
+    for(size_t i=0; i<n; ++i) {
+        mean_a += a[i];
+        mean_b += b[layout[i]];
+    }
+    mean_a /= n;
+    mean_b /= n;
+    double cov = 0, var_a = 0, var_b = 0;
+    for(size_t i=0; i<n; ++i) {
+        cov += (a[i] - mean_a)*(b[layout[i]] - mean_b);
+        var_a += (a[i] - mean_a)*(a[i] - mean_a);
+        var_b += (b[layout[i]] - mean_b)*(b[layout[i]] - mean_b);
+    }
+    return var_a > 0 && var_b > 0 ? cov/std::sqrt(var_a*var_b) : 1;
+}
+
+// windows of the scan, row by row as in cv::HOGDescriptor::compute()
+static std::vector<cv::Rect> scan_windows(const cv::Size& image, const cv::Size& window, const size_t stride) {
+    std::vector<cv::Rect> windows;
+    for(int y=0; y+window.height<=image.height; y+=stride)
+        for(int x=0; x+window.width<=image.width; x+=stride)
+            windows.push_back(cv::Rect(x, y, window.width, window.height));
+    return windows;
+}
+
+static double intersection_over_union(const cv::Rect& a, const cv::Rect& b) {
+    const double intersection = (a & b).area();
+    return intersection/(a.area() + b.area() - intersection);
+}
+
+// number of detections of "a" overlapping one of "b"
+static size_t matched(const std::vector<cv::Rect>& a, const std::vector<cv::Rect>& b) {
+    return std::count_if(std::begin(a), std::end(a), [&b](const cv::Rect& r) {
+        return std::any_of(std::begin(b), std::end(b), [&r](const cv::Rect& s) { return intersection_over_union(r, s) >= 0.5; });
+    });
+}
+
+static std::string usage(const char* program) {
+    return std::string("Usage: ") + program + " [--baseline <file>] [--save <file>] [--repetitions <n>]\n";
+}
+
+int main(int argc, char* argv[]) {
+
+    std::string baseline_file, save_file;
+    size_t repetitions = 10;
+    for(int i=1; i<argc; i+=2) {
+        if(i+1 == argc) {
+            std::cout << "Missing value of " << argv[i] << "\n" << usage(argv[0]);
+            return 1;
+        }
+        if(std::strcmp(argv[i], "--baseline") == 0)
+            baseline_file = argv[i+1];
+        else if(std::strcmp(argv[i], "--save") == 0)
+            save_file = argv[i+1];
+        else if(std::strcmp(argv[i], "--repetitions") == 0)
+            repetitions = std::max(1, std::atoi(argv[i+1]));
+        else {
+            std::cout << "Unknown option " << argv[i] << "\n" << usage(argv[0]);
+            return 1;
+        }
+    }
+
+    cv::Mat image = cv::imread("../test_performance/00001665.jpg", CV_8U);
+    if(!image.data) {
+        std::cout << "Could not read ../test_performance/00001665.jpg\n";
+        return 1;
+    }
+
+    const std::vector<Config> configs = {{8, 16, 8, 9}, {8, 16, 8, 18}, {8, 16, 16, 9}, {6, 12, 6, 9}, {4, 8, 4, 9}};
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts = {1};
+    if(max_threads > 1)
+        thread_counts.push_back(max_threads);
+
+    // speed ratio and correlation of each run, by name
+    std::map<std::string, std::pair<double, double>> results;
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "cell block stride bins | image | threads | windows | HOG: windows/s p50 p99 [ms] RSS [MB] | "
+              << "cv::HOGDescriptor: windows/s p50 p99 [ms] RSS [MB] | speedup | correlation\n";
+    for(const auto& config : configs) {
+        const cv::Size window(8*config.cellsize, 16*config.cellsize);
+        const std::vector<size_t> layout = opencv_layout(config, window);
+        for(double scale : {0.5, 1.0, 2.0}) {
+            cv::Mat resized;
+            cv::resize(image, resized, cv::Size(), scale, scale, cv::INTER_LINEAR);
+            const std::vector<cv::Rect> windows = scan_windows(resized.size(), window, config.cellsize);
+
+            for(size_t n_threads : thread_counts) {
+                HOG hog(config.blocksize, config.cellsize, config.stride, config.binning,
+                        HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+                hog.set_num_threads(n_threads);
+                cv::HOGDescriptor cv_hog(window, cv::Size(config.blocksize, config.blocksize),
+                                         cv::Size(config.stride, config.stride), cv::Size(config.cellsize, config.cellsize),
+                                         config.binning, 1, -1, cv::HOGDescriptor::L2Hys, 0.2, false);
+                cv::setNumThreads(n_threads);
+
+                std::vector<cv::Rect> scanned;
+                cv::Mat descriptors;
+                reset_peak_rss();
+                const Latency latency = measure_latency([&]() {
+                    hog.process(resized);
+                    descriptors = hog.scan(window, config.cellsize, scanned);
+                }, repetitions);
+                const long rss = peak_rss_kb();
+                descriptors.release();
+
+                std::vector<float> cv_descriptors;
+                reset_peak_rss();
+                const Latency cv_latency = measure_latency([&]() {
+                    cv_hog.compute(resized, cv_descriptors, cv::Size(config.cellsize, config.cellsize), cv::Size(0, 0));
+                }, repetitions);
+                const long cv_rss = peak_rss_kb();
+
+                // average correlation of the windows
+                double mean_correlation = 0;
+                cv::Mat ours = hog.retrieve_batch(windows);
+                for(size_t i=0; i<windows.size(); ++i)
+                    mean_correlation += correlation(ours.ptr<float>(i), &cv_descriptors[i*layout.size()], layout);
+                mean_correlation /= windows.size();
+
+                const double speedup = cv_latency.p50/latency.p50;
+                std::ostringstream name;
+                name << "c" << config.cellsize << "_b" << config.blocksize << "_s" << config.stride << "_n" << config.binning
+                     << "_x" << scale << "_t" << (n_threads == 1 ? "1" : "all");
+                results[name.str()] = std::make_pair(speedup, mean_correlation);
+
+                std::cout << config.cellsize << " " << config.blocksize << " " << config.stride << " " << config.binning << " | "
+                          << resized.cols << "x" << resized.rows << " | " << n_threads << " | " << windows.size() << " | "
+                          << 1000*windows.size()/latency.mean << " " << latency.p50 << " " << latency.p99 << " " << rss/1024.0 << " | "
+                          << 1000*windows.size()/cv_latency.mean << " " << cv_latency.p50 << " " << cv_latency.p99 << " " << cv_rss/1024.0 << " | "
+                          << speedup << " | " << mean_correlation << "\n";
+            }
+        }
+    }
+
+    // People detection at one scale with the default detector of OpenCV: the weights are
+    // reordered for the descriptor of HOG, whose windows are scored as in cv::HOGDescriptor::detect().
+    // cv::HOGDescriptor is built as in the sweep, without the gamma correction of its defaults
+    std::cout << "\nimage | detections HOG | detections cv::HOGDescriptor | agreement HOG->cv cv->HOG\n";
+    const Config people = {8, 16, 8, 9};
+    const cv::Size people_window(64, 128);
+    const std::vector<size_t> layout = opencv_layout(people, people_window);
+    const std::vector<float> detector = cv::HOGDescriptor::getDefaultPeopleDetector();
+    cv::HOGDescriptor cv_people(people_window, cv::Size(people.blocksize, people.blocksize),
+                                cv::Size(people.stride, people.stride), cv::Size(people.cellsize, people.cellsize),
+                                people.binning, 1, -1, cv::HOGDescriptor::L2Hys, 0.2, false);
+    cv_people.setSVMDetector(detector);
+    HOG hog_people(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    std::vector<float> weights(layout.size());
+    for(size_t i=0; i<layout.size(); ++i)
+        weights[i] = detector[layout[i]];
+    const float bias = detector.size() > layout.size() ? detector[layout.size()] : 0;
+
+    size_t n_detections = 0, n_cv_detections = 0, n_matched = 0, n_cv_matched = 0;
+    for(const std::string filename : {"../img/person.JPG", "../img/astronaut.JPG", "../test_performance/00001665.jpg"}) {
+        cv::Mat img = cv::imread(filename, CV_8U);
+        const std::vector<cv::Rect> windows = scan_windows(img.size(), people_window, 8);
+        hog_people.process(img);
+        cv::Mat descriptors = hog_people.retrieve_batch(windows);
+        std::vector<cv::Rect> detections;
+        for(size_t i=0; i<windows.size(); ++i)
+            if(std::inner_product(weights.begin(), weights.end(), descriptors.ptr<float>(i), bias) >= 0)
+                detections.push_back(windows[i]);
+
+        std::vector<cv::Point> locations;
+        cv_people.detect(img, locations, 0, cv::Size(8, 8), cv::Size(0, 0));
+        std::vector<cv::Rect> cv_detections;
+        for(const auto& location : locations)
+            cv_detections.push_back(cv::Rect(location.x, location.y, people_window.width, people_window.height));
+
+        const size_t m = matched(detections, cv_detections);
+        const size_t cv_m = matched(cv_detections, detections);
+        std::cout << filename << " | " << detections.size() << " | " << cv_detections.size() << " | "
+                  << m << "/" << detections.size() << " " << cv_m << "/" << cv_detections.size() << "\n";
+        n_detections += detections.size();
+        n_cv_detections += cv_detections.size();
+        n_matched += m;
+        n_cv_matched += cv_m;
+    }
+    std::cout << "total | " << n_detections << " | " << n_cv_detections << " | " << n_matched << "/" << n_detections << " "
+              << n_cv_matched << "/" << n_cv_detections << "\n";
+
+    if(!save_file.empty()) {
+        std::ofstream file(save_file);
+        file << std::setprecision(6);
+        for(const auto& result : results)
+            file << result.first << " " << result.second.first << " " << result.second.second << "\n";
+        std::cout << "\nBaseline saved to " << save_file << "\n";
+    }
+
+    if(!baseline_file.empty()) {
+        std::ifstream file(baseline_file);
+        if(!file) {
+            std::cout << "\nCould not read the baseline " << baseline_file << "\n";
+            return 1;
+        }
+        bool regression = false;
+        std::string name;
+        double speedup, mean_correlation;
+        while(file >> name >> speedup >> mean_correlation) {
+            auto result = results.find(name);
+            if(result == results.end())
+                continue;
+            if(result->second.first < speedup*(1 - SPEEDUP_TOLERANCE)) {
+                std::cout << "Regression " << name << ": speedup " << result->second.first << " (baseline " << speedup << ")\n";
+                regression = true;
+            }
+            if(result->second.second < mean_correlation - CORRELATION_TOLERANCE) {
+                std::cout << "Regression " << name << ": correlation " << result->second.second
+                          << " (baseline " << mean_correlation << ")\n";
+                regression = true;
+            }
+        }
+        if(regression)
+            return 1;
+        std::cout << "\nNo regression against " << baseline_file << "\n";
+    }
+
+    return 0;
+}
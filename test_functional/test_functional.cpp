@@ -10,12 +10,23 @@
     =========================================================================
 */
 #include "HOG.hpp"
+#include "SimdKernels.hpp"
+#include "ProductQuantizer.hpp"
+#include "StreamScheduler.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include <iostream>
 #include <algorithm>
 #include <memory>
 #include <iomanip>
+#include <fstream>
+#include <numeric>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <cmath>
 
 int main(int argc, char* argv[]) {
 
@@ -155,6 +166,38 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    {   // This test verifies that a window placed at half a cell (phase-shifted grid)
+        // gives the same HOG as the same window retrieved from a sub-image
+        // starting at the window's origin.
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        cv::Rect r = cv::Rect(4,12,64,64);
+
+        try {
+            HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::none);
+            hog.set_phases(3);
+            std::cout << "Test cellsize not a multiple of n_phases failed!\n";  exit(-1);
+        } catch(...) { }
+
+        HOG hog1(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::none);
+        hog1.set_phases(2);
+        hog1.process(image);
+        auto hist1 = hog1.retrieve(r);
+
+        HOG hog2(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::none);
+        hog2.process(cv::Mat(image, cv::Rect(r.x, r.y, image.cols-r.x, image.rows-r.y)));
+        auto hist2 = hog2.retrieve(cv::Rect(0,0,r.width,r.height));
+
+        if(hist1.size() != hist2.size()) {
+            std::cout << "Test phase-shifted retrieve failed (hist size wrong)! " << hist1.size() << "\n"; exit(-1);
+        }
+        for(size_t i=0; i<hist1.size(); ++i) {
+            if(std::abs(hist1[i]-hist2[i])>1e-3) {
+                std::cout << "Test phase-shifted retrieve failed!\n";  exit(-1);
+            }
+        }
+    }
+
     {   // Testing the copy constructor and the assignment operator
         
         // full image
@@ -218,6 +261,984 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    {   // Testing save and load of the feature map, with and without mmap
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        cv::Rect r = cv::Rect(8,16,64,128);
+
+        HOG hog1(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog1.set_phases(2);
+        hog1.process(image);
+        auto hist1 = hog1.retrieve(r);
+        auto hist1_shifted = hog1.retrieve(cv::Rect(r.x+4, r.y+4, r.width, r.height));
+
+        hog1.save("hog_cells.ext");
+        hog1.save("hog_blocks.ext", true);
+
+        std::vector<HOG> loaded = {HOG::load("hog_cells.ext"), HOG::load("hog_cells.ext", true),
+                                   HOG::load("hog_blocks.ext"), HOG::load("hog_blocks.ext", true)};
+        for(auto& hog2 : loaded) {
+            auto hist2 = hog2.retrieve(r);
+            auto hist2_shifted = hog2.retrieve(cv::Rect(r.x+4, r.y+4, r.width, r.height));
+            if(hist1.size() != hist2.size() || hist1_shifted.size() != hist2_shifted.size()) {
+                std::cout << "Test save-load feature map failed (hist size wrong)!\n";  exit(-1);
+            }
+            for(size_t i=0; i<hist1.size(); ++i) {
+                if(std::abs(hist1[i]-hist2[i])>1e-6 || std::abs(hist1_shifted[i]-hist2_shifted[i])>1e-6) {
+                    std::cout << "Test save-load feature map failed!\n";  exit(-1);
+                }
+            }
+        }
+
+        // a copy keeps the mapping alive
+        HOG hog3 = HOG::load("hog_blocks.ext", true);
+        {
+            HOG hog4 = HOG::load("hog_blocks.ext", true);
+            hog3 = hog4;
+        }
+        auto hist3 = hog3.retrieve(r);
+        for(size_t i=0; i<hist1.size(); ++i) {
+            if(std::abs(hist1[i]-hist3[i])>1e-6) {
+                std::cout << "Test save-load mapped copy failed!\n";  exit(-1);
+            }
+        }
+
+        try {
+            std::ofstream f("hog_invalid.ext", std::ios::binary);
+            f << "this is not a HOG file, but it is long enough to hold a header...........................";
+            f.close();
+            HOG::load("hog_invalid.ext");
+            std::cout << "Test load invalid file failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) { }
+    }
+
+    {   // Testing the FHOG (Felzenszwalb) features
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        cv::Rect r = cv::Rect(8,16,64,128);
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_feature_mode(HOG::FEATURE_MODE::felzenszwalb);
+        hog.process(image);
+        auto hist = hog.retrieve(r);
+        if(hist.size() != 8*16*31) {
+            std::cout << "Test FHOG retrieve failed (hist size wrong)! " << hist.size() << "\n"; exit(-1);
+        }
+        for(size_t i=0; i<hist.size(); ++i) {
+            const float max = i%31 < 27 ? 0.4 : 0.2357*18*0.2;
+            if(hist[i] < 0 || hist[i] > max+1e-5) {
+                std::cout << "Test FHOG range failed!\n";  exit(-1);
+            }
+        }
+
+        // the feature map holds the same features as retrieve()
+        cv::Mat feature_map = hog.get_feature_map();
+        if(feature_map.channels() != 31 || feature_map.rows != image.rows/8 || feature_map.cols != image.cols/8) {
+            std::cout << "Test FHOG feature map failed (size wrong)!\n";  exit(-1);
+        }
+        for(int y=0; y<16; ++y) {
+            for(int x=0; x<8*31; ++x) {
+                if(feature_map.ptr<float>(r.y/8 + y)[r.x/8*31 + x] != hist[y*8*31 + x]) {
+                    std::cout << "Test FHOG feature map failed!\n";  exit(-1);
+                }
+            }
+        }
+
+        // a flat image has no features
+        hog.process(cv::Mat::ones(64,64,CV_8U));
+        auto flat = hog.retrieve(cv::Rect(0,0,64,64));
+        if(std::any_of(std::begin(flat), std::end(flat), [](float v) { return v != 0; })) {
+            std::cout << "Test FHOG flat image failed!\n";  exit(-1);
+        }
+
+        // save and load, with the features stored or computed again
+        hog.process(image);
+        hog.save("hog_fhog.ext");
+        hog.save("hog_fhog_features.ext", true);
+        for(auto& hog2 : {HOG::load("hog_fhog.ext"), HOG::load("hog_fhog_features.ext", true)}) {
+            auto hist2 = HOG(hog2).retrieve(r);
+            for(size_t i=0; i<hist.size(); ++i) {
+                if(std::abs(hist[i]-hist2[i])>1e-6) {
+                    std::cout << "Test FHOG save-load failed!\n";  exit(-1);
+                }
+            }
+        }
+    }
+
+    {   // Testing the fixed-point pipeline against the floating point one
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        const size_t cellsize = 8;
+
+        for(auto grad_type : {HOG::GRADIENT_UNSIGNED, HOG::GRADIENT_SIGNED}) {
+            HOG hog_float(16, cellsize, 8, 9, grad_type, HOG::BLOCK_NORM::none);
+            HOG hog_fixed(16, cellsize, 8, 9, grad_type, HOG::BLOCK_NORM::none);
+            hog_fixed.set_compute_mode(HOG::COMPUTE_MODE::fixed_point);
+
+            // a sub-image, so that the pixels around the ROI are used as well
+            cv::Mat sub = cv::Mat(image, cv::Rect(3, 5, 250, 270));
+            hog_float.process(sub);
+            hog_fixed.process(sub);
+            if(!hog_fixed.get_magnitudes().empty()) {
+                std::cout << "Test fixed-point magnitudes failed!\n";  exit(-1);
+            }
+
+            // the magnitude of each pixel is rounded to 1/32: the total of a cell
+            // doesn't depend on the binning and is bounded by cellsize*cellsize/32
+            cv::Rect r = cv::Rect(0, 0, 240, 264);
+            auto hist_float = hog_float.retrieve(r);
+            auto hist_fixed = hog_fixed.retrieve(r);
+            if(hist_float.size() != hist_fixed.size()) {
+                std::cout << "Test fixed-point retrieve failed (hist size wrong)!\n";  exit(-1);
+            }
+            double sum_diff = 0;
+            for(size_t i=0; i<hist_float.size(); i+=9) {
+                const float cell_float = std::accumulate(&hist_float[i], &hist_float[i]+9, 0.0f);
+                const float cell_fixed = std::accumulate(&hist_fixed[i], &hist_fixed[i]+9, 0.0f);
+                if(std::abs(cell_float-cell_fixed) > cellsize*cellsize/32.0 + 1e-2) {
+                    std::cout << "Test fixed-point cell total failed! " << cell_float << " " << cell_fixed << "\n";  exit(-1);
+                }
+                for(size_t k=i; k<i+9; ++k)
+                    sum_diff += std::abs(hist_float[k]-hist_fixed[k]);
+            }
+            // the bins differ only for the pixels close to a bin boundary
+            const double sum_float = std::accumulate(std::begin(hist_float), std::end(hist_float), 0.0);
+            if(sum_diff/sum_float > 0.02) {
+                std::cout << "Test fixed-point histograms failed! " << sum_diff/sum_float << "\n";  exit(-1);
+            }
+        }
+
+        // other image types use the floating point path
+        HOG hog_fixed(16, cellsize, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog_fixed.set_compute_mode(HOG::COMPUTE_MODE::fixed_point);
+        cv::Mat image_float;
+        image.convertTo(image_float, CV_32F);
+        hog_fixed.process(image_float);
+        if(hog_fixed.get_magnitudes().empty()) {
+            std::cout << "Test fixed-point fallback failed!\n";  exit(-1);
+        }
+    }
+
+    {   // Testing the batch processing of crops against process() and retrieve()
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+
+        // crops of different sizes but with the same number of cells
+        std::vector<cv::Mat> crops;
+        const std::vector<cv::Size> sizes = {cv::Size(64,128), cv::Size(66,130), cv::Size(70,135)};
+        for(size_t i=0; i<50; ++i) {
+            const cv::Size size = sizes[i%sizes.size()];
+            crops.push_back(cv::Mat(image, cv::Rect((i*37)%(image.cols-size.width), (i*53)%(image.rows-size.height),
+                                                    size.width, size.height)));
+        }
+
+        for(auto feature_mode : {HOG::FEATURE_MODE::dalal_triggs, HOG::FEATURE_MODE::felzenszwalb}) {
+            HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+            hog.set_feature_mode(feature_mode);
+            hog.set_num_threads(3);
+            cv::Mat descriptors = hog.process_batch(crops);
+            if(descriptors.rows != static_cast<int>(crops.size()) ||
+               descriptors.cols != static_cast<int>(hog.descriptor_size(cv::Size(64,128)))) {
+                std::cout << "Test batch failed (size wrong)!\n";  exit(-1);
+            }
+            HOG hog_single(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+            hog_single.set_feature_mode(feature_mode);
+            for(size_t i=0; i<crops.size(); ++i) {
+                hog_single.process(crops[i]);
+                auto hist = hog_single.retrieve(cv::Rect(0, 0, crops[i].cols, crops[i].rows));
+                for(size_t k=0; k<hist.size(); ++k) {
+                    if(hist[k] != descriptors.at<HOG::TType>(i,k)) {
+                        std::cout << "Test batch failed!\n";  exit(-1);
+                    }
+                }
+            }
+        }
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        crops.push_back(cv::Mat(image, cv::Rect(0, 0, 64, 136)));
+        try {
+            hog.process_batch(crops);
+            std::cout << "Test batch of different sizes failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+    }
+
+    {   // Testing the tiled sliding window scan against retrieve()
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        cv::Mat sub = cv::Mat(image, cv::Rect(0, 0, 300, 260));
+        const cv::Size window(64,128);
+
+        for(auto feature_mode : {HOG::FEATURE_MODE::dalal_triggs, HOG::FEATURE_MODE::felzenszwalb}) {
+            HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+            hog.set_feature_mode(feature_mode);
+            hog.set_phases(2);
+            hog.set_num_threads(3);
+            hog.process(sub);
+            for(size_t stride : {4, 8, 24}) {
+                std::vector<cv::Rect> windows;
+                cv::Mat descriptors = hog.scan(window, stride, windows);
+                const size_t n_windows = ((sub.cols-window.width)/stride + 1)*((sub.rows-window.height)/stride + 1);
+                if(windows.size() != n_windows || descriptors.rows != static_cast<int>(n_windows)) {
+                    std::cout << "Test scan failed (number of windows wrong)!\n";  exit(-1);
+                }
+                std::set<std::pair<int,int>> positions;
+                for(size_t i=0; i<windows.size(); ++i) {
+                    positions.insert(std::make_pair(windows[i].x, windows[i].y));
+                    auto hist = hog.retrieve(windows[i]);
+                    if(static_cast<int>(hist.size()) != descriptors.cols) {
+                        std::cout << "Test scan failed (hist size wrong)!\n";  exit(-1);
+                    }
+                    for(size_t k=0; k<hist.size(); ++k) {
+                        if(hist[k] != descriptors.at<HOG::TType>(i,k)) {
+                            std::cout << "Test scan failed!\n";  exit(-1);
+                        }
+                    }
+                }
+                if(positions.size() != n_windows) {
+                    std::cout << "Test scan failed (windows repeated)!\n";  exit(-1);
+                }
+
+                // the slabs passed to the consumer hold the same rows
+                std::mutex mutex;
+                size_t n_consumed = 0;
+                hog.scan(window, stride, [&](const cv::Mat& slab, const cv::Rect* slab_windows) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for(int r=0; r<slab.rows; ++r) {
+                        const size_t i = std::find(std::begin(windows), std::end(windows), slab_windows[r]) - std::begin(windows);
+                        if(i == windows.size() || cv::norm(slab.row(r), descriptors.row(i), cv::NORM_INF) != 0) {
+                            std::cout << "Test scan with consumer failed!\n";  exit(-1);
+                        }
+                    }
+                    n_consumed += slab.rows;
+                });
+                if(n_consumed != n_windows) {
+                    std::cout << "Test scan with consumer failed (number of windows wrong)!\n";  exit(-1);
+                }
+            }
+        }
+    }
+
+    {   // Testing the asynchronous process and retrieve against the blocking ones
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        std::vector<cv::Rect> windows;
+        for(int i=0; i<20; ++i)
+            windows.push_back(cv::Rect(i*7, i*5, 64, 128));
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_phases(2);
+        hog.process(image);
+
+        std::future<HOG> processed;
+        std::atomic<int> n_callbacks(0);
+        {
+            // the object may go away before the task is done
+            HOG hog_async(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+            hog_async.set_phases(2);
+            hog_async.set_num_threads(2);
+            processed = hog_async.process_async(image, [&](const HOG&) { ++n_callbacks; });
+        }
+        HOG hog_async = processed.get();
+
+        std::future<cv::Mat> retrieved = hog_async.retrieve_async(windows,
+            [&](const cv::Mat& descriptors, const std::vector<cv::Rect>& w) {
+                if(descriptors.rows == static_cast<int>(w.size()))
+                    ++n_callbacks;
+            });
+        // the next image doesn't affect the pending retrieve
+        hog_async.process(cv::Mat(image, cv::Rect(0, 0, 128, 128)));
+        cv::Mat descriptors = retrieved.get();
+        if(n_callbacks != 2 || descriptors.rows != static_cast<int>(windows.size())) {
+            std::cout << "Test async callbacks failed!\n";  exit(-1);
+        }
+        for(size_t i=0; i<windows.size(); ++i) {
+            auto hist = hog.retrieve(windows[i]);
+            for(size_t k=0; k<hist.size(); ++k) {
+                if(hist[k] != descriptors.at<HOG::TType>(i,k)) {
+                    std::cout << "Test async retrieve failed!\n";  exit(-1);
+                }
+            }
+        }
+
+        // the errors of the task are stored in the future
+        std::future<HOG> failed = hog.process_async(cv::Mat::ones(8, 8, CV_8U));
+        try {
+            failed.get();
+            std::cout << "Test async process error failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+        try {
+            hog_async.retrieve_async({cv::Rect(0, 0, 64, 256)});
+            std::cout << "Test async retrieve out of image failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+    }
+
+    {   // Testing the cascade: the accepted windows have the score of the full linear model,
+        // the positives used to learn the thresholds are kept and fewer blocks are built
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        cv::Mat sub = cv::Mat(image, cv::Rect(0, 0, 304, 304)).clone();
+        const cv::Size window(64,128);
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.process(sub);
+
+        // a template of one window, minus a constant so that most of the windows score low
+        const cv::Rect target(96, 64, 64, 128);
+        HOG::THist weights = hog.retrieve(target);
+        const HOG::TType mean = std::accumulate(std::begin(weights), std::end(weights), 0.0f)/weights.size();
+        for(auto& w : weights)
+            w -= mean;
+        HOG::Cascade cascade = hog.make_cascade(weights, -1.0f, window, 4);
+        size_t n_cascade_blocks = 0;
+        for(const auto& stage : cascade.stages)
+            n_cascade_blocks += stage.size();
+        if(cascade.stages.size() != 4 || n_cascade_blocks != weights.size()/36 || cascade.stages[0].size() >= cascade.stages[3].size()) {
+            std::cout << "Test cascade stages failed!\n";  exit(-1);
+        }
+
+        std::vector<cv::Rect> positives;
+        for(int dy=-8; dy<=8; dy+=8)
+            for(int dx=-8; dx<=8; dx+=8)
+                positives.push_back(cv::Rect(target.x+dx, target.y+dy, 64, 128));
+        hog.learn_thresholds(cascade, hog.retrieve_batch(positives));
+
+        std::vector<HOG::TType> scores;
+        HOG::CascadeStats stats;
+        std::vector<cv::Rect> detections = hog.detect(window, 8, cascade, scores, &stats);
+        for(const auto& positive : positives) {
+            if(std::find(std::begin(detections), std::end(detections), positive) == std::end(detections)) {
+                std::cout << "Test cascade positives failed!\n";  exit(-1);
+            }
+        }
+        for(size_t i=0; i<detections.size(); ++i) {
+            auto hist = hog.retrieve(detections[i]);
+            const HOG::TType score = std::inner_product(std::begin(hist), std::end(hist), std::begin(weights), -1.0f);
+            if(std::abs(score-scores[i]) > 1e-3*std::max(1.0f, std::abs(score))) {
+                std::cout << "Test cascade score failed! " << score << " " << scores[i] << "\n";  exit(-1);
+            }
+        }
+        const size_t n_full_blocks = stats.n_windows*(weights.size()/36);
+        if(stats.n_rejected == 0 || stats.n_rejected + detections.size() != stats.n_windows || stats.n_blocks >= n_full_blocks) {
+            std::cout << "Test cascade rejection failed!\n";  exit(-1);
+        }
+
+        HOG::TType score;
+        if(!hog.cascade_score(target, cascade, score)) {
+            std::cout << "Test cascade score of the target failed!\n";  exit(-1);
+        }
+        try {
+            HOG::Cascade wrong = cascade;
+            wrong.weights.pop_back();
+            hog.detect(window, 8, wrong, scores);
+            std::cout << "Test cascade wrong size failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+
+        // the same detections when the image is streamed in bands
+        std::vector<cv::Rect> streamed;
+        std::vector<HOG::TType> streamed_scores;
+        HOG::CascadeStats streamed_stats;
+        hog.stream_detect(sub.size(), sub.type(), HOG::mat_reader(sub), window, 8, 150, cascade,
+                          [&](const std::vector<cv::Rect>& d, const std::vector<HOG::TType>& s) {
+            streamed.insert(std::end(streamed), std::begin(d), std::end(d));
+            streamed_scores.insert(std::end(streamed_scores), std::begin(s), std::end(s));
+        }, &streamed_stats);
+        if(streamed.size() != detections.size() || streamed_stats.n_windows != stats.n_windows ||
+           streamed_stats.n_blocks != stats.n_blocks) {
+            std::cout << "Test cascade stream failed!\n";  exit(-1);
+        }
+        for(size_t i=0; i<streamed.size(); ++i) {
+            const size_t j = std::find(std::begin(detections), std::end(detections), streamed[i]) - std::begin(detections);
+            if(j == detections.size() || scores[j] != streamed_scores[i]) {
+                std::cout << "Test cascade stream failed (detections differ)!\n";  exit(-1);
+            }
+        }
+
+        // the same with trilinear voting, whose cells also take votes from the rows around the bands
+        HOG hog_trilinear = hog;
+        hog_trilinear.set_voting(HOG::VOTING::trilinear);
+        hog_trilinear.process(sub);
+        std::vector<HOG::TType> trilinear_scores;
+        const auto trilinear_detections = hog_trilinear.detect(window, 8, cascade, trilinear_scores, &stats);
+        streamed.clear();
+        streamed_scores.clear();
+        hog_trilinear.stream_detect(sub.size(), sub.type(), HOG::mat_reader(sub), window, 8, 150, cascade,
+                                    [&](const std::vector<cv::Rect>& d, const std::vector<HOG::TType>& s) {
+            streamed.insert(std::end(streamed), std::begin(d), std::end(d));
+            streamed_scores.insert(std::end(streamed_scores), std::begin(s), std::end(s));
+        }, &streamed_stats);
+        if(trilinear_detections.empty() || streamed.size() != trilinear_detections.size() || 
+           streamed_stats.n_rejected != stats.n_rejected) {
+            std::cout << "Test cascade stream trilinear failed!\n";  exit(-1);
+        }
+        for(size_t i=0; i<streamed.size(); ++i) {
+            const size_t j = std::find(std::begin(trilinear_detections), std::end(trilinear_detections), streamed[i]) - 
+                             std::begin(trilinear_detections);
+            if(j == trilinear_detections.size() || trilinear_scores[j] != streamed_scores[i]) {
+                std::cout << "Test cascade stream trilinear failed (detections differ)!\n";  exit(-1);
+            }
+        }
+    }
+
+    {   // Testing the band streaming against process() and retrieve() of the whole image
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        const cv::Size window(48,64);
+
+        // trilinear voting: the edge cells of a band also get votes from the rows around it
+        for(auto voting : {HOG::VOTING::hard, HOG::VOTING::trilinear}) {
+            for(auto feature_mode : {HOG::FEATURE_MODE::dalal_triggs, HOG::FEATURE_MODE::felzenszwalb}) {
+                for(size_t stride : {4, 12}) {
+                    HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+                    hog.set_feature_mode(feature_mode);
+                    hog.set_voting(voting);
+                    hog.set_phases(2);
+                    hog.process(image);
+
+                    for(size_t band_height : {64, 100, 400}) {
+                        size_t n_windows = 0;
+                        size_t n_read = 0;
+                        int last_y = -1;
+                        auto reader = [&](const size_t y, cv::Mat& rows) {
+                            // each row is read once, from the top
+                            if(y != n_read) {
+                                std::cout << "Test stream failed (rows read twice)!\n";  exit(-1);
+                            }
+                            n_read += rows.rows;
+                            image.rowRange(y, y + rows.rows).copyTo(rows);
+                        };
+                        hog.stream(image.size(), image.type(), reader, window, stride, band_height,
+                                   [&](const cv::Mat& descriptors, const std::vector<cv::Rect>& windows) {
+                            for(size_t i=0; i<windows.size(); ++i) {
+                                if(windows[i].y < last_y) {
+                                    std::cout << "Test stream failed (bands out of order)!\n";  exit(-1);
+                                }
+                                last_y = windows[i].y;
+                                auto hist = hog.retrieve(windows[i]);
+                                for(size_t k=0; k<hist.size(); ++k) {
+                                    if(std::abs(hist[k]-descriptors.at<HOG::TType>(i,k)) > 1e-5) {
+                                        std::cout << "Test stream failed! " << windows[i] << " " << band_height << "\n";  exit(-1);
+                                    }
+                                }
+                            }
+                            n_windows += windows.size();
+                        });
+                        if(n_windows != ((image.cols-window.width)/stride + 1)*((image.rows-window.height)/stride + 1) ||
+                           n_read > static_cast<size_t>(image.rows)) {
+                            std::cout << "Test stream failed (number of windows wrong)!\n";  exit(-1);
+                        }
+                    }
+                }
+            }
+        }
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        try {
+            hog.stream(image.size(), image.type(), HOG::mat_reader(image), window, 8, 32,
+                       [](const cv::Mat&, const std::vector<cv::Rect>&) {});
+            std::cout << "Test stream band smaller than window failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+    }
+
+    {   // Testing the feature pyramid: the exact one against process() of the resized images,
+        // the approximated levels against the exact ones
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        const cv::Size window(64,64);
+
+        for(auto feature_mode : {HOG::FEATURE_MODE::dalal_triggs, HOG::FEATURE_MODE::felzenszwalb}) {
+            HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+            hog.set_feature_mode(feature_mode);
+            hog.set_phases(2);
+
+            std::vector<double> scales, approximated_scales;
+            std::vector<HOG> exact = hog.process_pyramid(image, window, 4, 4, scales);
+            std::vector<HOG> approximated = hog.process_pyramid(image, window, 4, 1, approximated_scales);
+            if(exact.size() != 10 || scales.size() != exact.size() || approximated_scales != scales ||
+               approximated.size() != exact.size()) {
+                std::cout << "Test pyramid failed (number of levels wrong)!\n";  exit(-1);
+            }
+
+            double error = 0, norm = 0;
+            for(size_t l=0; l<exact.size(); ++l) {
+                cv::Mat resized;
+                cv::resize(image, resized, cv::Size(std::round(image.cols*scales[l]), std::round(image.rows*scales[l])), 0, 0, cv::INTER_LINEAR);
+                hog.process(resized);
+                for(int y=0; y+window.height<=resized.rows; y+=12) {
+                    for(int x=0; x+window.width<=resized.cols; x+=12) {
+                        const cv::Rect r(x, y, window.width, window.height);
+                        auto hist = hog.retrieve(r);
+                        auto hist_exact = exact[l].retrieve(r);
+                        auto hist_approximated = approximated[l].retrieve(r);
+                        for(size_t k=0; k<hist.size(); ++k) {
+                            if(std::abs(hist[k]-hist_exact[k]) > 1e-5 ||
+                               (l % 4 == 0 && std::abs(hist[k]-hist_approximated[k]) > 1e-5)) {
+                                std::cout << "Test pyramid failed! " << l << " " << r << "\n";  exit(-1);
+                            }
+                            error += (hist[k]-hist_approximated[k])*(hist[k]-hist_approximated[k]);
+                            norm += hist[k]*hist[k];
+                        }
+                    }
+                }
+            }
+            if(std::sqrt(error/norm) > 0.35) {
+                std::cout << "Test pyramid failed (approximation error " << std::sqrt(error/norm) << ")!\n";  exit(-1);
+            }
+        }
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        std::vector<double> scales;
+        try {
+            hog.process_pyramid(image, window, 4, 3, scales);
+            std::cout << "Test pyramid real levels not dividing the octave failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+    }
+
+    {   // Testing that the kernels of every instruction set give the same output, bit for bit
+
+        std::vector<float> a(77), b(77);
+        for(size_t i=0; i<a.size(); ++i) {
+            a[i] = std::sin(i*0.37f)*(i+1);
+            b[i] = std::cos(i*0.11f)/(i+1);
+        }
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        std::vector<cv::Rect> windows;
+        for(int x=0; x+64<=image.cols; x+=24)
+            for(int y=0; y+128<=image.rows; y+=24)
+                windows.push_back(cv::Rect(x, y, 64, 128));
+
+        auto outputs = [&]() {
+            std::vector<float> out;
+            for(size_t n=0; n<=a.size(); ++n) {
+                out.push_back(SimdKernels::sum(a.data(), n));
+                out.push_back(SimdKernels::sum_squares(a.data(), n));
+                out.push_back(SimdKernels::dot(a.data(), b.data(), n));
+                std::vector<float> v(a.begin(), a.begin()+n);
+                SimdKernels::clamp(v.data(), n, 0.0f, 2.0f);
+                SimdKernels::sqrt(v.data(), n);
+                SimdKernels::divide(v.data(), n, 3.0f);
+                out.insert(out.end(), v.begin(), v.end());
+            }
+            for(auto norm : {HOG::BLOCK_NORM::L1norm, HOG::BLOCK_NORM::L1sqrt, HOG::BLOCK_NORM::L2norm, HOG::BLOCK_NORM::L2hys}) {
+                HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, norm);
+                hog.process(image);
+                cv::Mat descriptors = hog.retrieve_batch(windows);
+                out.insert(out.end(), descriptors.ptr<float>(0), descriptors.ptr<float>(0) + descriptors.total());
+                HOG::Cascade cascade = hog.make_cascade(HOG::THist(descriptors.cols, 0.5f), -1, cv::Size(64,128), 4);
+                for(const auto& window : windows) {
+                    HOG::TType score;
+                    hog.cascade_score(window, cascade, score);
+                    out.push_back(score);
+                }
+            }
+            return out;
+        };
+
+        const SimdKernels::ISA startup_isa = SimdKernels::isa();
+        const std::vector<SimdKernels::ISA> isas = SimdKernels::supported_isas();
+        if(isas.empty() || isas[0] != SimdKernels::ISA::generic || 
+           std::find(isas.begin(), isas.end(), startup_isa) == isas.end()) {
+            std::cout << "Test ISA failed (supported instruction sets wrong)!\n";  exit(-1);
+        }
+        SimdKernels::set_isa(SimdKernels::ISA::generic);
+        const std::vector<float> reference = outputs();
+        for(auto isa : isas) {
+            SimdKernels::set_isa(isa);
+            if(SimdKernels::isa() != isa || outputs() != reference) {
+                std::cout << "Test ISA failed! " << SimdKernels::name(isa) << "\n";  exit(-1);
+            }
+        }
+        SimdKernels::set_isa(startup_isa);
+    }
+
+    {   // Testing the vector mask: the one of a ROI is the same ROI of the whole mask,
+        // whatever the number of threads
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        for(auto feature_mode : {HOG::FEATURE_MODE::dalal_triggs, HOG::FEATURE_MODE::felzenszwalb}) {
+            for(int thickness : {1, 2, 5}) {
+                HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+                hog.set_feature_mode(feature_mode);
+                hog.process(image);
+                const cv::Mat vector_mask = hog.get_vector_mask(thickness);
+                if(vector_mask.size() != image.size() || vector_mask.type() != CV_8U ||
+                   vector_mask.at<uint8_t>(7, 100) != 255 || vector_mask.at<uint8_t>(100, 15) != 255) {
+                    std::cout << "Test vector mask failed (grid wrong)!\n";  exit(-1);
+                }
+                size_t n_lines = 0;
+                for(int y=0; y<vector_mask.rows; ++y)
+                    for(int x=0; x<vector_mask.cols; ++x)
+                        n_lines += vector_mask.at<uint8_t>(y, x) > 0 && vector_mask.at<uint8_t>(y, x) < 255;
+                if(n_lines == 0) {
+                    std::cout << "Test vector mask failed (no lines)!\n";  exit(-1);
+                }
+
+                for(const cv::Rect roi : {cv::Rect(0, 0, 310, 310), cv::Rect(13, 27, 101, 77), cv::Rect(300, 5, 10, 300), cv::Rect(150, 150, 1, 1)}) {
+                    const cv::Mat roi_mask = hog.get_vector_mask(roi, thickness);
+                    if(roi_mask.size() != roi.size() || cv::norm(roi_mask, vector_mask(roi), cv::NORM_INF) != 0) {
+                        std::cout << "Test vector mask ROI failed! " << roi << " " << thickness << "\n";  exit(-1);
+                    }
+                }
+
+                hog.set_num_threads(1);
+                if(cv::norm(hog.get_vector_mask(thickness), vector_mask, cv::NORM_INF) != 0) {
+                    std::cout << "Test vector mask threads failed!\n";  exit(-1);
+                }
+            }
+        }
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.process(image);
+        try {
+            hog.get_vector_mask(cv::Rect(300, 300, 20, 20));
+            std::cout << "Test vector mask ROI outside of the image failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+    }
+
+    {   // Testing the product quantization: the asymmetric distances are the distances to the
+        // decoded codes, and the search finds the true nearest neighbours of most queries
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.process(image);
+        std::vector<cv::Rect> windows;
+        const cv::Mat descriptors = hog.scan(cv::Size(48,64), 4, windows);
+
+        ProductQuantizer quantizer;
+        quantizer.train(descriptors, hog.block_hist_size(), 256, 10);
+        const cv::Mat codes = quantizer.encode(descriptors);
+        const size_t n_blocks = hog.descriptor_size(cv::Size(48,64))/hog.block_hist_size();
+        if(n_blocks != 35 || quantizer.n_blocks() != n_blocks || quantizer.n_centroids() != 256 || codes.type() != CV_8U ||
+           codes.rows != descriptors.rows || codes.cols != static_cast<int>(n_blocks)) {
+            std::cout << "Test PQ failed (sizes wrong)!\n";  exit(-1);
+        }
+
+        // the quantization error is small compared to the norm of the descriptors (one per block)
+        const cv::Mat decoded = quantizer.decode(codes);
+        double error = 0;
+        for(int i=0; i<descriptors.rows; ++i)
+            error += cv::norm(descriptors.row(i), decoded.row(i));
+        if(error/descriptors.rows > 0.5*std::sqrt(n_blocks)) {
+            std::cout << "Test PQ failed (quantization error " << error/descriptors.rows << ")!\n";  exit(-1);
+        }
+
+        size_t n_found = 0;
+        const size_t n_queries = 50;
+        for(size_t q=0; q<n_queries; ++q) {
+            const cv::Mat query = descriptors.row(q*descriptors.rows/n_queries);
+            const std::vector<float> distances = quantizer.distances(query, codes);
+            for(int i=0; i<codes.rows; i+=97) {
+                const double exact = cv::norm(query, decoded.row(i))*cv::norm(query, decoded.row(i));
+                if(std::abs(distances[i] - exact) > 1e-3*(1 + exact)) {
+                    std::cout << "Test PQ failed (distance " << distances[i] << " " << exact << ")!\n";  exit(-1);
+                }
+            }
+            const auto neighbours = quantizer.search(query, codes, 10);
+            if(neighbours.size() != 10 || neighbours[0].distance != *std::min_element(distances.begin(), distances.end())) {
+                std::cout << "Test PQ search failed!\n";  exit(-1);
+            }
+            for(size_t k=1; k<neighbours.size(); ++k) {
+                if(neighbours[k].distance < neighbours[k-1].distance || neighbours[k].distance != distances[neighbours[k].index]) {
+                    std::cout << "Test PQ search failed (order wrong)!\n";  exit(-1);
+                }
+            }
+            // the query itself, excluded, is the trivial nearest neighbour
+            int nearest = -1;
+            double nearest_distance = std::numeric_limits<double>::max();
+            for(int i=0; i<descriptors.rows; ++i) {
+                const double d = cv::norm(query, descriptors.row(i));
+                if(i != static_cast<int>(q*descriptors.rows/n_queries) && d < nearest_distance) {
+                    nearest_distance = d;
+                    nearest = i;
+                }
+            }
+            const auto more_neighbours = quantizer.search(query, codes, 20);
+            n_found += std::any_of(more_neighbours.begin(), more_neighbours.end(), 
+                                   [nearest](const ProductQuantizer::Neighbour& n) { return static_cast<int>(n.index) == nearest; });
+        }
+        if(n_found < 0.8*n_queries) {
+            std::cout << "Test PQ search failed (recall " << n_found << "/" << n_queries << ")!\n";  exit(-1);
+        }
+
+        quantizer.save("test_pq.ext");
+        ProductQuantizer loaded = ProductQuantizer::load("test_pq.ext");
+        if(cv::norm(loaded.encode(descriptors), codes, cv::NORM_INF) != 0) {
+            std::cout << "Test PQ save/load failed!\n";  exit(-1);
+        }
+
+        try {
+            quantizer.encode(descriptors.colRange(0, 36));
+            std::cout << "Test PQ wrong size failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+
+        // with fewer than 256 centroids some codes are out of range
+        ProductQuantizer small;
+        small.train(descriptors, hog.block_hist_size(), 16, 10);
+        try {
+            small.decode(cv::Mat(1, codes.cols, CV_8U, cv::Scalar(16)));
+            std::cout << "Test PQ code out of range failed!\n";  exit(-1);
+        } catch(const std::runtime_error&) {}
+        cv::Mat small_codes = small.encode(descriptors);
+        for(int b=0; b<small_codes.cols; ++b)
+            small_codes.ptr<ProductQuantizer::Code>(0)[b] = 255;
+        const auto small_neighbours = small.search(descriptors.row(1), small_codes, small_codes.rows);
+        if(small_neighbours.back().index != 0 || small_neighbours.back().distance != std::numeric_limits<float>::infinity() ||
+           !std::isfinite(small_neighbours.front().distance)) {
+            std::cout << "Test PQ search code out of range failed!\n";  exit(-1);
+        }
+    }
+
+    {   // Testing the bands of process() and the stream scheduler
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        cv::Mat flipped;
+        cv::flip(image, flipped, 1);
+        const cv::Size window(64,128);
+
+        // the bands give the same features whatever the number of threads
+        for(auto feature_mode : {HOG::FEATURE_MODE::dalal_triggs, HOG::FEATURE_MODE::felzenszwalb}) {
+            for(auto compute_mode : {HOG::COMPUTE_MODE::floating_point, HOG::COMPUTE_MODE::fixed_point}) {
+                HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+                hog.set_feature_mode(feature_mode);
+                hog.set_compute_mode(compute_mode);
+                HOG hog_single = hog;
+                hog.set_num_threads(3);
+                hog_single.set_num_threads(1);
+                hog.process(image);
+                hog_single.process(image);
+                std::vector<cv::Rect> windows;
+                if(cv::norm(hog.scan(window, 8, windows), hog_single.scan(window, 8, windows), cv::NORM_INF) != 0) {
+                    std::cout << "Test process bands failed!\n";  exit(-1);
+                }
+            }
+        }
+
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        std::vector<cv::Mat> expected(2);
+        std::vector<cv::Rect> expected_windows;
+        hog.process(image);
+        expected[0] = hog.scan(window, 8, expected_windows);
+        hog.process(flipped);
+        expected[1] = hog.scan(window, 8, expected_windows);
+
+        std::mutex mutex;
+        std::vector<StreamScheduler::FrameResult> results;
+        auto consume = [&](const StreamScheduler::FrameResult& result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            results.push_back(result);
+        };
+
+        // with a loose deadline every frame is processed at the stride of its stream
+        {
+            StreamScheduler scheduler(std::make_shared<WorkStealingPool>(3));
+            const size_t first = scheduler.add_stream(hog, {window, 8, 32, 0, 1e5, 0, consume});
+            const size_t second = scheduler.add_stream(hog, {window, 8, 32, 1, 1e5, 0, consume});
+            for(int i=0; i<4; ++i) {
+                scheduler.submit(first, image);
+                scheduler.submit(second, flipped);
+            }
+            scheduler.flush();
+            std::vector<size_t> next_frame(2, 0);
+            for(const auto& result : results) {
+                if(result.frame != next_frame[result.stream]++ || result.stride != 8 || !result.deadline_met ||
+                   result.windows != expected_windows || 
+                   cv::norm(result.descriptors, expected[result.stream], cv::NORM_INF) != 0) {
+                    std::cout << "Test scheduler failed!\n";  exit(-1);
+                }
+            }
+            for(size_t stream : {first, second}) {
+                const StreamScheduler::StreamStats stats = scheduler.stats(stream);
+                if(stats.submitted != 4 || stats.processed != 4 || stats.dropped != 0 || stats.degraded != 0 ||
+                   stats.p50_ms <= 0 || stats.p99_ms < stats.p50_ms) {
+                    std::cout << "Test scheduler stats failed!\n";  exit(-1);
+                }
+            }
+        }
+
+        // with a deadline shorter than a frame, the frames after the first are degraded or dropped
+        {
+            results.clear();
+            const auto start = std::chrono::steady_clock::now();
+            hog.process(image);
+            hog.scan(window, 8, expected_windows);
+            const double frame_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            StreamScheduler scheduler(std::make_shared<WorkStealingPool>(2));
+            const size_t stream = scheduler.add_stream(hog, {window, 8, 64, 0, 0.2*frame_ms, 0, consume});
+            for(int i=0; i<6; ++i) {
+                scheduler.submit(stream, image);
+                scheduler.flush();
+            }
+            const StreamScheduler::StreamStats stats = scheduler.stats(stream);
+            if(stats.submitted != 6 || stats.processed + stats.dropped != 6 || stats.degraded + stats.dropped < 5 ||
+               stats.processed != results.size()) {
+                std::cout << "Test scheduler deadline failed!\n";  exit(-1);
+            }
+            for(const auto& result : results) {
+                std::vector<cv::Rect> windows;
+                hog.process(image);
+                if(cv::norm(result.descriptors, hog.scan(window, result.stride, windows), cv::NORM_INF) != 0 ||
+                   result.windows != windows) {
+                    std::cout << "Test scheduler deadline failed (stride " << result.stride << ")!\n";  exit(-1);
+                }
+            }
+        }
+
+        // the errors of the frames are thrown by flush()
+        {
+            StreamScheduler scheduler;
+            const size_t stream = scheduler.add_stream(hog, {window, 8, 8, 0, 1e5, 0, nullptr});
+            scheduler.submit(stream, image(cv::Rect(0, 0, 32, 32)));
+            try {
+                scheduler.flush();
+                std::cout << "Test scheduler error failed!\n";  exit(-1);
+            } catch(const std::runtime_error&) {}
+        }
+    }
+
+    {   // Testing the trilinear voting against a pixel by pixel implementation
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        const size_t cellsize = 8;
+        // 7 bins don't divide 180 degrees, the last bin still wraps around to the first one
+        for(size_t binning : {9, 7}) {
+            HOG hog(cellsize, cellsize, cellsize, binning, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::none);
+            hog.set_voting(HOG::VOTING::trilinear);
+            hog.process(image);
+            const cv::Mat mag = hog.get_magnitudes();
+            const cv::Mat ori = hog.get_orientations();
+            const int n_cells_y = image.rows/cellsize;
+            const int n_cells_x = image.cols/cellsize;
+            std::vector<double> expected(n_cells_y*n_cells_x*binning, 0);
+            for(int y=0; y<n_cells_y*static_cast<int>(cellsize); ++y) {
+                for(int x=0; x<n_cells_x*static_cast<int>(cellsize); ++x) {
+                    double orientation = ori.at<float>(y,x);
+                    if(orientation >= 180)
+                        orientation -= 180;
+                    const double b = orientation/(180.0/binning) - 0.5;
+                    const double u = (x + 0.5)/cellsize - 0.5;
+                    const double v = (y + 0.5)/cellsize - 0.5;
+                    const int b0 = std::floor(b), x0 = std::floor(u), y0 = std::floor(v);
+                    for(int k=0; k<8; ++k) {
+                        const int bin = ((b0 + k%2) + binning) % binning;
+                        const int cx = x0 + (k/2)%2;
+                        const int cy = y0 + k/4;
+                        if(cx < 0 || cx >= n_cells_x || cy < 0 || cy >= n_cells_y)
+                            continue;
+                        const double weight = (k%2 ? b-b0 : 1-(b-b0))*((k/2)%2 ? u-x0 : 1-(u-x0))*(k/4 ? v-y0 : 1-(v-y0));
+                        expected[(cy*n_cells_x + cx)*binning + bin] += weight*mag.at<float>(y,x);
+                    }
+                }
+            }
+            const auto hist = hog.retrieve(cv::Rect(0, 0, n_cells_x*cellsize, n_cells_y*cellsize));
+            for(size_t k=0; k<hist.size(); ++k) {
+                if(std::abs(hist[k] - expected[k]) > 1e-3*(1 + expected[k])) {
+                    std::cout << "Test trilinear voting failed (" << binning << " bins)! " << hist[k] << " " << expected[k] << "\n";  exit(-1);
+                }
+            }
+        }
+
+        // the voting is saved with the features, the phases and the threads don't change it
+        HOG hog_blocks(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog_blocks.set_voting(HOG::VOTING::trilinear);
+        hog_blocks.set_phases(2);
+        hog_blocks.set_num_threads(3);
+        hog_blocks.process(image);
+        hog_blocks.save("test_trilinear.ext");
+        HOG loaded = HOG::load("test_trilinear.ext");
+        HOG hog_single = hog_blocks;
+        hog_single.set_num_threads(1);
+        hog_single.process(image);
+        const cv::Rect window(4, 12, 64, 128);
+        if(loaded.get_voting() != HOG::VOTING::trilinear || loaded.retrieve(window) != hog_blocks.retrieve(window) ||
+           hog_single.retrieve(window) != hog_blocks.retrieve(window)) {
+            std::cout << "Test trilinear voting save/load failed!\n";  exit(-1);
+        }
+    }
+
+    {   // Testing the energy map and the windows skipped by the dense functions
+
+        cv::Mat image = cv::imread("../img/astronaut.JPG", CV_8U);
+        const cv::Size window(48,64);
+
+        // with one cell per block and no normalization the HOG of a window is its cells
+        HOG hog_cells(8, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::none);
+        hog_cells.set_phases(2);
+        hog_cells.set_energy_threshold(1e-6f);
+        hog_cells.process(image);
+        for(int y=0; y+window.height<=image.rows; y+=20) {
+            for(int x=0; x+window.width<=image.cols; x+=12) {
+                const cv::Rect roi(x, y, window.width, window.height);
+                const auto hist = hog_cells.retrieve(roi);
+                const double expected = std::accumulate(hist.begin(), hist.end(), 0.0)/window.area();
+                if(std::abs(hog_cells.window_energy(roi) - expected) > 1e-4*(1 + expected)) {
+                    std::cout << "Test window energy failed! " << hog_cells.window_energy(roi) << " " << expected << "\n";  exit(-1);
+                }
+            }
+        }
+
+        // the windows under the median energy are skipped and all zeros, the others unchanged
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        HOG hog_skip = hog;
+        hog.process(image);
+        hog_skip.set_energy_threshold(1e-6f);
+        hog_skip.process(image);
+        std::vector<cv::Rect> windows;
+        const cv::Mat descriptors = hog.scan(window, 8, windows);
+        std::vector<double> energies;
+        for(const auto& roi : windows)
+            energies.push_back(hog_skip.window_energy(roi));
+        std::vector<double> sorted(energies);
+        std::nth_element(sorted.begin(), sorted.begin() + sorted.size()/2, sorted.end());
+        const HOG::TType threshold = sorted[sorted.size()/2];
+        hog_skip.set_energy_threshold(threshold);
+        hog_skip.process(image);
+
+        std::vector<cv::Rect> skip_windows;
+        const cv::Mat skip_descriptors = hog_skip.scan(window, 8, skip_windows);
+        size_t n_skipped = 0;
+        for(size_t i=0; i<windows.size(); ++i) {
+            const bool skipped = energies[i] < threshold;
+            n_skipped += skipped;
+            if(cv::norm(skip_descriptors.row(i), skipped ? cv::Mat::zeros(1, descriptors.cols, CV_32F) : descriptors.row(i), 
+                        cv::NORM_INF) != 0) {
+                std::cout << "Test energy scan failed!\n";  exit(-1);
+            }
+        }
+        if(n_skipped == 0 || n_skipped == windows.size() || hog_skip.skipped_windows() != n_skipped) {
+            std::cout << "Test energy scan failed (" << n_skipped << " skipped)!\n";  exit(-1);
+        }
+        if(cv::norm(hog_skip.retrieve_batch(skip_windows), skip_descriptors, cv::NORM_INF) != 0 || 
+           hog_skip.skipped_windows() != 2*n_skipped) {
+            std::cout << "Test energy retrieve_batch failed!\n";  exit(-1);
+        }
+
+        // the skipped windows are never detections, and are not counted as rejected by the stages
+        HOG::Cascade cascade = hog.make_cascade(HOG::THist(descriptors.cols, 0.01f), -1, window, 4);
+        std::vector<HOG::TType> scores;
+        HOG::CascadeStats stats;
+        const auto detections = hog.detect(window, 8, cascade, scores, &stats);
+        const auto skip_detections = hog_skip.detect(window, 8, cascade, scores, &stats);
+        if(detections.size() != windows.size() || skip_detections.size() != windows.size() - n_skipped ||
+           stats.n_skipped != n_skipped || stats.n_rejected != 0) {
+            std::cout << "Test energy detect failed!\n";  exit(-1);
+        }
+        
+        // with thresholds, some windows are rejected by the stages among the ones not skipped
+        std::vector<cv::Rect> positives(1, windows[windows.size()/2]);
+        hog.learn_thresholds(cascade, hog.retrieve_batch(positives));
+        const auto all_detections = hog.detect(window, 8, cascade, scores, &stats);
+        const size_t n_rejected = windows.size() - all_detections.size();
+        size_t n_rejected_not_skipped = 0;
+        for(size_t i=0; i<windows.size(); ++i)
+            n_rejected_not_skipped += energies[i] >= threshold && 
+                                      std::find(all_detections.begin(), all_detections.end(), windows[i]) == all_detections.end();
+        hog_skip.detect(window, 8, cascade, scores, &stats);
+        if(n_rejected == 0 || stats.n_skipped != n_skipped || stats.n_rejected != n_rejected_not_skipped ||
+           stats.n_windows != windows.size()) {
+            std::cout << "Test energy detect stats failed!\n";  exit(-1);
+        }
+    }
+
     std::cout << "\nTest passed!\n\n"; exit(0);
     
     return 0;
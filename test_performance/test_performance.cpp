@@ -10,6 +10,9 @@
     =========================================================================
 */
 #include "HOG.hpp"
+#include "SimdKernels.hpp"
+#include "ProductQuantizer.hpp"
+#include "StreamScheduler.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include <iostream>
@@ -17,6 +20,11 @@
 #include <memory>
 #include <functional>
 #include <chrono>
+#include <array>
+#include <numeric>
+#include <thread>
+#include <atomic>
+#include <limits>
 
 template<typename TimeT = std::chrono::milliseconds>
 struct measure
@@ -58,7 +66,7 @@ int main(int argc, char* argv[]) {
         size_t blocksize = cellsize*2;
         size_t stride = cellsize;
         size_t binning = 9;
-        HOG hog(blocksize, cellsize, stride, binning, HOG::GRADIENT_UNSIGNED, HOG::L2hys);
+        HOG hog(blocksize, cellsize, stride, binning, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
         hog.process(image);
         
         cv::Size window(50,100);
@@ -87,6 +95,285 @@ int main(int argc, char* argv[]) {
     res = mean_stddev<3>::run([&](){return measure<>::run(function,8);});
     std::cout << "Time elapsed (n_threads=8): " << res.first << "(+-" << res.second << ") [ms]\n";
 
+    // FHOG (31 values per cell) vs. the concatenation of blocks (36 values per block)
+    auto function_features = [](const HOG::FEATURE_MODE feature_mode){
+        cv::Mat image = cv::imread("00001665.jpg", CV_8U);
+
+        size_t cellsize = 8;
+        HOG hog(cellsize*2, cellsize, cellsize, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_feature_mode(feature_mode);
+        hog.process(image);
+
+        cv::Size window(64,128);
+        for(int x=0; x<image.cols-window.width; x += cellsize){
+            for(int y=0; y<image.rows-window.height; y += cellsize){
+                cv::Rect r = cv::Rect(x,y, window.width, window.height);
+                auto hist = hog.retrieve(r);
+            }
+        }
+    };
+
+    res = mean_stddev<3>::run([&](){return measure<>::run(function_features, HOG::FEATURE_MODE::dalal_triggs);});
+    std::cout << "Time elapsed (blocks, n_threads=1): " << res.first << "(+-" << res.second << ") [ms]\n";
+    res = mean_stddev<3>::run([&](){return measure<>::run(function_features, HOG::FEATURE_MODE::felzenszwalb);});
+    std::cout << "Time elapsed (FHOG, n_threads=1): " << res.first << "(+-" << res.second << ") [ms]\n";
+
+    // floating point vs. fixed-point process()
+    auto function_compute = [](const HOG::COMPUTE_MODE compute_mode){
+        cv::Mat image = cv::imread("00001665.jpg", CV_8U);
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_compute_mode(compute_mode);
+        hog.process(image);
+    };
+
+    res = mean_stddev<3>::run([&](){return measure<>::run(function_compute, HOG::COMPUTE_MODE::floating_point);});
+    std::cout << "Time elapsed (process floating point): " << res.first << "(+-" << res.second << ") [ms]\n";
+    res = mean_stddev<3>::run([&](){return measure<>::run(function_compute, HOG::COMPUTE_MODE::fixed_point);});
+    std::cout << "Time elapsed (process fixed-point): " << res.first << "(+-" << res.second << ") [ms]\n";
+
+    // hard vs. trilinear voting: time of process() and change of the descriptors when
+    // the image moves by half a stride, the error of a scan with twice the stride
+    auto function_voting = [](const HOG::VOTING voting){
+        cv::Mat image = cv::imread("00001665.jpg", CV_8U);
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_voting(voting);
+        hog.process(image);
+    };
+    for(auto voting : {HOG::VOTING::hard, HOG::VOTING::trilinear}) {
+        const std::string name = voting == HOG::VOTING::hard ? "hard" : "trilinear";
+        res = mean_stddev<3>::run([&](){return measure<>::run(function_voting, voting);});
+        cv::Mat image = cv::imread("00001665.jpg", CV_8U);
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_voting(voting);
+        HOG hog_shifted = hog;
+        hog.process(image);
+        hog_shifted.process(image(cv::Rect(4, 4, image.cols-4, image.rows-4)));
+        std::vector<cv::Rect> windows;
+        const cv::Mat descriptors = hog.scan(cv::Size(64,128), 16, windows);
+        double change = 0;
+        int n_windows = 0;
+        for(int i=0; i<descriptors.rows; ++i) {
+            if(windows[i].br().x > image.cols-4 || windows[i].br().y > image.rows-4)
+                continue;
+            const auto shifted = hog_shifted.retrieve(windows[i]);
+            change += cv::norm(descriptors.row(i), cv::Mat(shifted).reshape(1,1))/cv::norm(descriptors.row(i));
+            ++n_windows;
+        }
+        std::cout << "Time elapsed (process, " << name << " voting): " << res.first << "(+-" << res.second << ") [ms], "
+                  << "relative change of the descriptors for a shift of 4 pixels: " << change/n_windows << "\n";
+    }
+
+    // dense detection in a street scene skipping the flat windows (sky, walls, road) by their energy,
+    // one stage so that all the blocks of the other windows are scored
+    for(HOG::TType threshold : {0.0f, 2.0f, 4.0f, 8.0f}) {
+        cv::Mat image = cv::imread("00001665.jpg", CV_8U);
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_energy_threshold(threshold);
+        hog.process(image);
+        const HOG::Cascade cascade = hog.make_cascade(HOG::THist(hog.descriptor_size(cv::Size(64,128)), 0.01f), -1, cv::Size(64,128), 1);
+        std::vector<HOG::TType> scores;
+        HOG::CascadeStats stats;
+        res = mean_stddev<3>::run([&](){return measure<>::run([&](){ hog.detect(cv::Size(64,128), 8, cascade, scores, &stats); });});
+        std::cout << "Time elapsed (detect, energy threshold " << threshold << "): " << res.first << "(+-" << res.second << ") [ms], "
+                  << "skipped windows: " << stats.n_skipped << "/" << stats.n_windows << "\n";
+    }
+
+    // many small crops: one process()/retrieve() per crop vs. process_batch()
+    cv::Mat image = cv::imread("00001665.jpg", CV_8U);
+    std::vector<cv::Mat> crops;
+    for(int x=0; x<image.cols-64; x += 16)
+        for(int y=0; y<image.rows-128; y += 16)
+            crops.push_back(cv::Mat(image, cv::Rect(x, y, 64, 128)));
+
+    auto function_crops = [&crops](){
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        for(const auto& crop : crops) {
+            hog.process(crop);
+            auto hist = hog.retrieve(cv::Rect(0, 0, crop.cols, crop.rows));
+        }
+    };
+    auto function_batch = [&crops](const size_t n_threads){
+        HOG hog(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+        hog.set_num_threads(n_threads);
+        cv::Mat descriptors = hog.process_batch(crops);
+    };
+
+    res = mean_stddev<3>::run([&](){return measure<>::run(function_crops);});
+    std::cout << "Time elapsed (" << crops.size() << " crops, one by one): " << res.first << "(+-" << res.second << ") [ms]\n";
+    for(size_t n_threads : {1, 2, 4, 8}) {
+        res = mean_stddev<3>::run([&](){return measure<>::run(function_batch, n_threads);});
+        std::cout << "Time elapsed (" << crops.size() << " crops, batch, n_threads=" << n_threads << "): "
+                  << res.first << "(+-" << res.second << ") [ms]\n";
+    }
+
+    // scaling of the tiled scan, from 1 thread to all the hardware threads;
+    // each window is scored by a linear classifier as in a detector
+    auto function_scan = [](HOG& hog){
+        const cv::Size window(50,100);
+        const HOG::THist weights(hog.descriptor_size(window), 0.01f);
+        std::atomic<size_t> n_positives(0);
+        hog.scan(window, 5, [&](const cv::Mat& descriptors, const cv::Rect* windows) {
+            for(int r=0; r<descriptors.rows; ++r) {
+                const HOG::TType* descriptor = descriptors.ptr<HOG::TType>(r);
+                if(std::inner_product(descriptor, descriptor + descriptors.cols, std::begin(weights), 0.0f) > 1.0f)
+                    ++n_positives;
+            }
+        });
+    };
+    HOG hog_scan(10, 5, 5, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    hog_scan.process(image);
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double time_1 = 0;
+    for(size_t n_threads=1; n_threads<=max_threads; n_threads *= 2) {
+        hog_scan.set_num_threads(n_threads);
+        res = mean_stddev<3>::run([&](){return measure<>::run(function_scan, hog_scan);});
+        if(n_threads == 1)
+            time_1 = res.first;
+        std::cout << "Time elapsed (scan, n_threads=" << n_threads << "): " << res.first << "(+-" << res.second << ") [ms]"
+                  << " speedup: " << time_1/res.first << "\n";
+        if(n_threads < max_threads && 2*n_threads > max_threads)
+            n_threads = max_threads/2;
+    }
+
+    // cascade vs. full linear scoring of a dense scan. The model is the mean-subtracted
+    // HOG of a person (a template matcher), its thresholds keep all the shifted templates
+    cv::Mat person;
+    cv::resize(cv::imread("../img/person.JPG", CV_8U), person, cv::Size(80,160));
+    HOG hog_cascade(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    hog_cascade.process(person);
+    HOG::THist weights = hog_cascade.retrieve(cv::Rect(8, 16, 64, 128));
+    const HOG::TType mean = std::accumulate(std::begin(weights), std::end(weights), 0.0f)/weights.size();
+    for(auto& w : weights)
+        w -= mean;
+    HOG::Cascade cascade = hog_cascade.make_cascade(weights, 0, cv::Size(64,128), 6);
+    std::vector<cv::Rect> positives;
+    for(int y=0; y<=32; y+=8)
+        for(int x=0; x<=16; x+=8)
+            positives.push_back(cv::Rect(x, y, 64, 128));
+    hog_cascade.learn_thresholds(cascade, hog_cascade.retrieve_batch(positives));
+    HOG::Cascade full = cascade;
+    std::fill(std::begin(full.thresholds), std::end(full.thresholds), -std::numeric_limits<HOG::TType>::max());
+
+    hog_cascade.process(image);
+    HOG::CascadeStats stats_full, stats_cascade;
+    auto function_detect = [&hog_cascade](const HOG::Cascade& model, HOG::CascadeStats& stats){
+        std::vector<HOG::TType> scores;
+        hog_cascade.detect(cv::Size(64,128), 8, model, scores, &stats);
+    };
+    res = mean_stddev<3>::run([&](){return measure<>::run(function_detect, full, stats_full);});
+    std::cout << "Time elapsed (full scoring): " << res.first << "(+-" << res.second << ") [ms], "
+              << stats_full.n_blocks << " normalized blocks\n";
+    res = mean_stddev<3>::run([&](){return measure<>::run(function_detect, cascade, stats_cascade);});
+    std::cout << "Time elapsed (cascade): " << res.first << "(+-" << res.second << ") [ms], "
+              << stats_cascade.n_blocks << " normalized blocks, " << stats_cascade.n_rejected << "/"
+              << stats_cascade.n_windows << " windows rejected\n";
+
+    // exact feature pyramid (8 processed levels per octave) vs. approximated ones
+    // (fewer processed levels, the others resampled), with the error of the descriptors
+    HOG hog_pyramid(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    const cv::Size pyramid_window(64,128);
+    std::vector<double> scales;
+    std::vector<HOG> exact;
+    res = mean_stddev<3>::run([&](){return measure<>::run([&](){ exact = hog_pyramid.process_pyramid(image, pyramid_window, 8, 8, scales); });});
+    std::cout << "Time elapsed (pyramid, " << scales.size() << " levels, exact): " << res.first << "(+-" << res.second << ") [ms]\n";
+    for(size_t real_per_octave : {4, 2, 1}) {
+        std::vector<HOG> approximated;
+        res = mean_stddev<3>::run([&](){return measure<>::run([&](){ 
+            approximated = hog_pyramid.process_pyramid(image, pyramid_window, 8, real_per_octave, scales); });});
+        double error = 0, norm = 0;
+        for(size_t l=0; l<exact.size(); ++l) {
+            std::vector<cv::Rect> windows;
+            cv::Mat descriptors = exact[l].scan(pyramid_window, 16, windows);
+            cv::Mat approximated_descriptors = approximated[l].retrieve_batch(windows);
+            for(int r=0; r<descriptors.rows; ++r) {
+                for(int k=0; k<descriptors.cols; ++k) {
+                    const double d = descriptors.at<HOG::TType>(r,k) - approximated_descriptors.at<HOG::TType>(r,k);
+                    error += d*d;
+                    norm += descriptors.at<HOG::TType>(r,k)*descriptors.at<HOG::TType>(r,k);
+                }
+            }
+        }
+        std::cout << "Time elapsed (pyramid, " << real_per_octave << " real levels per octave): " << res.first 
+                  << "(+-" << res.second << ") [ms], relative error of the descriptors: " << std::sqrt(error/norm) << "\n";
+    }
+
+    // block norms and cascade scores with the kernels of each instruction set
+    HOG hog_isa(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    hog_isa.process(image);
+    const SimdKernels::ISA startup_isa = SimdKernels::isa();
+    for(auto isa : SimdKernels::supported_isas()) {
+        SimdKernels::set_isa(isa);
+        res = mean_stddev<3>::run([&](){return measure<>::run([&](){
+            std::vector<cv::Rect> windows;
+            cv::Mat descriptors = hog_isa.scan(cv::Size(64,128), 8, windows); });});
+        std::cout << "Time elapsed (scan, " << SimdKernels::name(isa) << "): " << res.first << "(+-" << res.second << ") [ms]\n";
+    }
+    SimdKernels::set_isa(startup_isa);
+
+    // vector mask of a 1080p frame, whole and a ROI, as in a live overlay
+    cv::Mat frame;
+    cv::resize(image, frame, cv::Size(1920,1080));
+    HOG hog_mask(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    hog_mask.process(frame);
+    res = mean_stddev<3>::run([&](){return measure<>::run([&](){ cv::Mat mask = hog_mask.get_vector_mask(2); });});
+    std::cout << "Time elapsed (vector mask 1920x1080): " << res.first << "(+-" << res.second << ") [ms]\n";
+    res = mean_stddev<3>::run([&](){return measure<>::run([&](){ cv::Mat mask = hog_mask.get_vector_mask(cv::Rect(640, 360, 640, 360), 2); });});
+    std::cout << "Time elapsed (vector mask ROI 640x360): " << res.first << "(+-" << res.second << ") [ms]\n";
+
+    // nearest neighbour search of a window among 1M windows: product-quantized codes
+    // (asymmetric distance) vs. brute force L2 on the descriptors
+    HOG hog_pq(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    hog_pq.process(image);
+    std::vector<cv::Rect> pq_windows;
+    const cv::Mat pq_descriptors = hog_pq.scan(cv::Size(64,128), 8, pq_windows);
+    ProductQuantizer quantizer;
+    res = mean_stddev<1>::run([&](){return measure<>::run([&](){ quantizer.train(pq_descriptors, hog_pq.block_hist_size(), 256, 10); });});
+    std::cout << "Time elapsed (PQ training, " << pq_descriptors.rows << " windows): " << res.first << " [ms]\n";
+    const cv::Mat pq_codes = quantizer.encode(pq_descriptors);
+    cv::Mat million_codes;
+    cv::repeat(pq_codes, (1000000 + pq_codes.rows - 1)/pq_codes.rows, 1, million_codes);
+    const cv::Mat query = pq_descriptors.row(pq_descriptors.rows/2).clone();
+    res = mean_stddev<3>::run([&](){return measure<>::run([&](){ quantizer.search(query, million_codes, 10); });});
+    std::cout << "Time elapsed (PQ search, " << million_codes.rows << " windows, " << million_codes.cols << " bytes each): " 
+              << res.first << "(+-" << res.second << ") [ms]\n";
+    volatile float nearest_distance = 0;
+    auto function_brute_force = [&](){
+        float best = std::numeric_limits<float>::max();
+        for(int i=0; i<pq_descriptors.rows; ++i) {
+            const float* d = pq_descriptors.ptr<float>(i);
+            float distance = 0;
+            for(int k=0; k<pq_descriptors.cols; ++k)
+                distance += (d[k] - query.at<float>(0,k))*(d[k] - query.at<float>(0,k));
+            best = std::min(best, distance);
+        }
+        nearest_distance = best;
+    };
+    res = mean_stddev<3>::run([&](){return measure<std::chrono::microseconds>::run(function_brute_force);});
+    std::cout << "Time elapsed (brute force L2, " << pq_descriptors.rows << " windows of " << pq_descriptors.cols << " floats): "
+              << res.first/1000 << " [ms], " << res.first/pq_descriptors.rows*1000000/1000 << " [ms] per 1M windows\n";
+
+    // 4 streams of 30 frames at 10 fps on one pool, the first stream having the priority
+    HOG hog_streams(16, 8, 8, 9, HOG::GRADIENT_UNSIGNED, HOG::BLOCK_NORM::L2hys);
+    {
+        StreamScheduler scheduler(std::make_shared<WorkStealingPool>(max_threads));
+        const size_t n_streams = 4;
+        for(size_t i=0; i<n_streams; ++i)
+            scheduler.add_stream(hog_streams, {cv::Size(64,128), 8, 32, i == 0 ? 1 : 0, 150, 2, nullptr});
+        const auto start = std::chrono::steady_clock::now();
+        for(int f=0; f<30; ++f) {
+            std::this_thread::sleep_until(start + std::chrono::milliseconds(100*f));
+            for(size_t i=0; i<n_streams; ++i)
+                scheduler.submit(i, image);
+        }
+        scheduler.flush();
+        for(size_t i=0; i<n_streams; ++i) {
+            const StreamScheduler::StreamStats stats = scheduler.stats(i);
+            std::cout << "Stream " << i << " (deadline 150 ms): processed " << stats.processed << "/" << stats.submitted 
+                      << ", degraded " << stats.degraded << ", dropped " << stats.dropped << ", late " << stats.late
+                      << ", p50 " << stats.p50_ms << " [ms], p99 " << stats.p99_ms << " [ms]\n";
+        }
+    }
+
     return 0;
 
 }